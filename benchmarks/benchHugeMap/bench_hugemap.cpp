@@ -28,6 +28,19 @@ void bench_hugemap::benchHugeInsert()
     }
 }
 
+void bench_hugemap::benchHugeInsertBatch()
+{
+    QFETCH(SINGLE_ARG(HugeMap<int, QString>), container);
+    QFETCH(const int, benchContSize);
+    QBENCHMARK{
+        QVector<QPair<int, QString> > items;
+        items.reserve(benchContSize);
+        for (int i = 0; i < benchContSize; ++i)
+        items.append(qMakePair(i, QString::number(i)));
+        container.insertBatch(items);
+    }
+}
+
 void bench_hugemap::benchHugeReadKey()
 {
     QFETCH(SINGLE_ARG(HugeMap<int, QString>), container);
@@ -82,6 +95,20 @@ void bench_hugemap::benchHugeReadIterReverse()
     }
 }
 
+void bench_hugemap::benchHugeContains()
+{
+    QFETCH(SINGLE_ARG(HugeMap<int, QString>), container);
+    QFETCH(const int, benchContSize);
+    for (int i = 0; i < benchContSize; ++i)
+        container.insert(i, QString::number(i));
+    bool found;
+    QBENCHMARK{
+        for (int i = 0; i < benchContSize; ++i)
+        found = container.contains(i);
+    }
+    Q_UNUSED(found)
+}
+
 void bench_hugemap::benchQtInsert_data()
 {
     QTest::addColumn<int >("benchContSize");
@@ -129,6 +156,20 @@ void bench_hugemap::benchQtReadIter()
     }
 }
 
+void bench_hugemap::benchQtContains()
+{
+    QFETCH(const int, benchContSize);
+    QMap<int, QString> benchQMap;
+    for (int i = 0; i < benchContSize; ++i)
+        benchQMap.insert(i, QString::number(i));
+    bool found;
+    QBENCHMARK{
+        for (int i = 0; i < benchContSize; ++i)
+        found = benchQMap.contains(i);
+    }
+    Q_UNUSED(found)
+}
+
 void bench_hugemap::benchStdInsert()
 {
     QFETCH(const int, benchContSize);
@@ -165,3 +206,41 @@ void bench_hugemap::benchStdReadIter()
         valueRead = i->second;
     }
 }
+
+void bench_hugemap::benchHugeHashFind_data()
+{
+    QTest::addColumn<int >("benchContSize");
+    QTest::newRow("10M") << 10000000;
+    QTest::newRow("100M") << 100000000;
+}
+
+void bench_hugemap::benchHugeHashFind()
+{
+    QFETCH(const int, benchContSize);
+    // Values stay inline in the index so only the lookup is measured
+    HugeHash<int, int> container;
+    container.setInlineSize(sizeof(int));
+    for (int i = 0; i < benchContSize; ++i)
+        container.insert(i, i);
+    bool found;
+    QBENCHMARK{
+        // Keys are visited out of order so each lookup misses the CPU cache
+        for (int i = 0; i < benchContSize; ++i)
+        found = container.contains(static_cast<int>((i * Q_INT64_C(7919)) % benchContSize));
+    }
+    Q_UNUSED(found)
+}
+
+void bench_hugemap::benchQtHashFind()
+{
+    QFETCH(const int, benchContSize);
+    QHash<int, int> benchQHash;
+    for (int i = 0; i < benchContSize; ++i)
+        benchQHash.insert(i, i);
+    bool found;
+    QBENCHMARK{
+        for (int i = 0; i < benchContSize; ++i)
+        found = benchQHash.contains(static_cast<int>((i * Q_INT64_C(7919)) % benchContSize));
+    }
+    Q_UNUSED(found)
+}
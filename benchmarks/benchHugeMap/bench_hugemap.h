@@ -7,20 +7,25 @@ class bench_hugemap : public QObject
     Q_OBJECT
 private slots:
     void benchHugeInsert_data();
+    void benchHugeInsertBatch_data() { benchHugeInsert_data(); }
     void benchHugeReadKey_data() { benchHugeInsert_data(); }
     void benchHugeReadIter_data() { benchHugeInsert_data(); }
     void benchHugeReadKeyReverse_data() { benchHugeInsert_data(); }
     void benchHugeReadIterReverse_data() { benchHugeInsert_data(); }
+    void benchHugeContains_data() { benchHugeInsert_data(); }
 
     void benchHugeInsert();
+    void benchHugeInsertBatch();
     void benchHugeReadKey();
     void benchHugeReadIter();
     void benchHugeReadKeyReverse();
     void benchHugeReadIterReverse();
+    void benchHugeContains();
 
     void benchQtInsert_data();
     void benchQtReadKey_data() { benchQtInsert_data(); }
     void benchQtReadIter_data() { benchQtInsert_data(); }
+    void benchQtContains_data() { benchQtInsert_data(); }
     void benchStdInsert_data() { benchQtInsert_data(); }
     void benchStdReadKey_data() { benchQtInsert_data(); }
     void benchStdReadIter_data() { benchQtInsert_data(); }
@@ -28,8 +33,15 @@ private slots:
     void benchQtInsert();
     void benchQtReadKey();
     void benchQtReadIter();
+    void benchQtContains();
     void benchStdInsert();
     void benchStdReadKey();
     void benchStdReadIter();
+
+    void benchHugeHashFind_data();
+    void benchQtHashFind_data() { benchHugeHashFind_data(); }
+
+    void benchHugeHashFind();
+    void benchQtHashFind();
 };
 #endif // bench_hugemap_h__
\ No newline at end of file
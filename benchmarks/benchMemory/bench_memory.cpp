@@ -49,6 +49,17 @@ QDataStream& operator>>(QDataStream& stream, MBdata& target)
     return stream;
 }
 
+// Memory used by the index of a HugeMap whose values are all in the file, in bytes per key
+double keyOverhead(int keyCount)
+{
+    const double origMem = getUsedMemory();
+    HugeContainers::HugeMap<int, int> overheadMap;
+    overheadMap.setMaxCache(1);
+    for (int i = 0; i < keyCount; ++i)
+        overheadMap.insert(i, i);
+    return (getUsedMemory() - origMem) * static_cast<double>(1024 * 1024) / static_cast<double>(keyCount);
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -96,6 +107,9 @@ int main(int argc, char *argv[])
     });
     addTimer.start();
     app.exec();
+    const int overheadKeys = 1000000;
+    const double bytesPerKey = keyOverhead(overheadKeys);
+    qDebug() << "Index overhead" << bytesPerKey << "bytes per key";
     writer.writeCharacters(
         "]);"
         "var options = {"
@@ -123,6 +137,9 @@ int main(int argc, char *argv[])
     writer.writeEmptyElement(QStringLiteral("br"));
     writer.writeCharacters("MBdata is basically a wrapper around char[1048576] which is 1MB in size.");
     writer.writeEndElement(); //p
+    writer.writeStartElement(QStringLiteral("p"));
+    writer.writeCharacters(QStringLiteral("Index overhead of a HugeMap<int, int> with ") + QString::number(overheadKeys) + QStringLiteral(" keys and a cache size of 1: ") + QString::number(bytesPerKey, 'f', 1) + QStringLiteral(" bytes per key"));
+    writer.writeEndElement(); //p
     writer.writeStartElement(QStringLiteral("div"));
     writer.writeAttribute(QStringLiteral("id"), QStringLiteral("memorychart"));
     //writer.writeAttribute(QStringLiteral("style"), QStringLiteral("width: 900px; height: 500px"));
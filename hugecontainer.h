@@ -27,28 +27,77 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <QDataStream>
 #include <QDir>
 #include <QDirIterator>
+#include <QElapsedTimer>
 #include <QHash>
 #include <QMap>
-#include <QQueue>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QReadWriteLock>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QSet>
+#include <QThreadPool>
+#include <QtAlgorithms>
 #include <QSharedData>
 #include <QSharedDataPointer>
 #include <QExplicitlySharedDataPointer>
 #include <QTemporaryFile>
+#include <QThread>
+#include <QIODevice>
+#include <QVector>
+#include <QWaitCondition>
+#include <algorithm>
+#include <cstring>
+#include <functional>
 #include <initializer_list>
+#include <limits>
+#include <list>
+#include <set>
 #include <map>
 #include <memory>
+#include <type_traits>
 #include <unordered_map>
 #include <QDebug>
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HUGECONTAINERS_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace HugeContainers {
     template <class KeyType, class ValueType, bool sorted>
     class HugeContainer;
+    template <class KeyType, class ValueType>
+    class ConcurrentHugeHash;
 }
 template <class KeyType, class ValueType, bool sorted>
 QDataStream& operator<<(QDataStream &out, const HugeContainers::HugeContainer<KeyType, ValueType, sorted>& cont);
 template <class KeyType, class ValueType, bool sorted>
 QDataStream& operator>>(QDataStream &in, HugeContainers::HugeContainer<KeyType, ValueType, sorted>& cont);
 namespace HugeContainers{
+    //! Strategy used to choose which cached value is written to disk when the cache is full
+    enum class CachePolicy
+    {
+        LRU //!< Least recently used
+        , Clock //!< Second chance FIFO, hits only set a reference bit
+        , LFU //!< Least frequently used, ties broken by recency
+        , ARC //!< Adaptive replacement cache
+        , TwoQueue //!< 2Q (A1in, A1out and Am queues)
+        , GDSF //!< Greedy dual size frequency, weighs the decoding cost per serialized byte
+    };
+
+    //! Specialize it deriving from std::true_type to store the values of a trivially copyable type as their bytes instead of through QDataStream.
+    //! Every block then has the same size so freed blocks are reused exactly, but the file depends on the layout of the type
+    template <class ValueType>
+    struct RawValueStorage : std::false_type {};
+
     //! Removes any leftover data from previous crashes
     inline void cleanUp(){
         QDirIterator cleanIter{ QDir::tempPath(), QStringList(QStringLiteral("HugeContainerData*")), QDir::Files | QDir::Writable | QDir::CaseSensitive | QDir::NoDotAndDotDot };
@@ -69,284 +118,3538 @@ namespace HugeContainers{
         template <class ValueType>
         struct ContainerObjectData : public QSharedData
         {
-            bool m_isAvailable;
-            union ObjectData
-            {
-                explicit ObjectData(qint64 fp)
-                    :m_fPos(fp)
-                {}
-                explicit ObjectData(ValueType* v)
-                    :m_val(v)
-                {}
-                qint64 m_fPos;
-                ValueType* m_val;
-            } m_data;            
-            explicit ContainerObjectData(qint64 fp)
+            // State of the intrusive cache, links are only set while the object is tracked by the cache
+            quint8 m_cacheList;
+            quint32 m_cacheFrequency;
+            qint64 m_cacheSize;
+            double m_cacheWeight;
+            double m_cachePriority;
+            ContainerObjectData* m_cachePrev;
+            ContainerObjectData* m_cacheNext;
+            // The value was evicted and is queued to be written by the background writer
+            bool m_isWriting;
+            // Position of the block reserved to the value in the file, -1 if there is none
+            qint64 m_fPos;
+            // Size of the copy of the value stored in the block, -1 if the block holds no up to date copy
+            int m_fSize;
+            // Value held in memory, nullptr if the value is only in the file
+            ValueType* m_val;
+            // Serialized copy of a small value kept here instead of the file, m_fPos is -1 and m_fSize its size
+            QByteArray m_inline;
+            ContainerObjectData(qint64 fp, int fs)
                 :QSharedData()
-                , m_isAvailable(false)
-                , m_data(fp)
+                , m_cacheList(0)
+                , m_cacheFrequency(0)
+                , m_cacheSize(0)
+                , m_cacheWeight(0.0)
+                , m_cachePriority(0.0)
+                , m_cachePrev(nullptr)
+                , m_cacheNext(nullptr)
+                , m_isWriting(false)
+                , m_fPos(fp)
+                , m_fSize(fs)
+                , m_val(nullptr)
             {}
             explicit ContainerObjectData(ValueType* v)
                 :QSharedData()
-                , m_isAvailable(true)
-                , m_data(v)
+                , m_cacheList(0)
+                , m_cacheFrequency(0)
+                , m_cacheSize(0)
+                , m_cacheWeight(0.0)
+                , m_cachePriority(0.0)
+                , m_cachePrev(nullptr)
+                , m_cacheNext(nullptr)
+                , m_isWriting(false)
+                , m_fPos(-1)
+                , m_fSize(-1)
+                , m_val(v)
             {
                 Q_ASSERT(v);
             }
+            explicit ContainerObjectData(const QByteArray& inlineBlock)
+                :QSharedData()
+                , m_cacheList(0)
+                , m_cacheFrequency(0)
+                , m_cacheSize(0)
+                , m_cacheWeight(0.0)
+                , m_cachePriority(0.0)
+                , m_cachePrev(nullptr)
+                , m_cacheNext(nullptr)
+                , m_isWriting(false)
+                , m_fPos(-1)
+                , m_fSize(inlineBlock.size())
+                , m_val(nullptr)
+                , m_inline(inlineBlock)
+            {}
             ~ContainerObjectData()
             {
-                if (m_isAvailable)
-                    delete m_data.m_val;
+                delete m_val;
             }
             ContainerObjectData(const ContainerObjectData& other)
                 :QSharedData(other)
-                , m_isAvailable(other.m_isAvailable)
-                , m_data(other.m_data.m_fPos)
+                , m_cacheList(0)
+                , m_cacheFrequency(other.m_cacheFrequency)
+                , m_cacheSize(other.m_cacheSize)
+                , m_cacheWeight(other.m_cacheWeight)
+                , m_cachePriority(other.m_cachePriority)
+                , m_cachePrev(nullptr)
+                , m_cacheNext(nullptr)
+                , m_isWriting(false)
+                , m_fPos(other.m_fPos)
+                , m_fSize(other.m_fSize)
+                , m_val(other.m_val ? new ValueType(*(other.m_val)) : nullptr)
+                , m_inline(other.m_inline)
+            {}
+            bool isAvailable() const { return m_val; }
+            // Linked in one of the queues of the cache, ghost ones included
+            bool isTracked() const { return m_cacheList != 0; }
+            // The value is in memory and the file does not hold a copy of it
+            bool isDirty() const { return m_val && m_fSize < 0; }
+            // The serialized value is kept in m_inline instead of the file
+            bool isInline() const { return m_fPos < 0 && m_fSize >= 0; }
+            // fp is -1 to keep the inline copy
+            void setFPos(qint64 fp, int fs)
+            {
+                Q_ASSERT(fs >= 0 && (fp >= 0 || isInline()));
+                delete m_val;
+                m_val = nullptr;
+                if (fp >= 0)
+                    m_inline.clear();
+                m_fPos = fp;
+                m_fSize = fs;
+            }
+            void setVal(ValueType* v, int fs)
+            {
+                Q_ASSERT(v);
+                Q_ASSERT(fs < 0 || m_fPos >= 0 || isInline());
+                if (m_val != v)
+                    delete m_val;
+                m_val = v;
+                m_fSize = fs;
+                if (fs < 0)
+                    m_inline.clear();
+            }
+            // The block in the file, if any, must have been freed already
+            void setInline(const QByteArray& block)
             {
-                if (m_isAvailable)
-                    m_data.m_val = new ValueType(*(other.m_data.m_val));
+                delete m_val;
+                m_val = nullptr;
+                m_inline = block;
+                m_fPos = -1;
+                m_fSize = block.size();
             }
         };
 
+        // Intrusive queue of objects tracked by the cache.
+        // Objects in a queue are never shared so the links can be stored inside them
         template <class ValueType>
-        class ContainerObject
+        class CacheQueue
+        {
+            ContainerObjectData<ValueType>* m_head;
+            ContainerObjectData<ValueType>* m_tail;
+            int m_size;
+        public:
+            CacheQueue()
+                : m_head(nullptr)
+                , m_tail(nullptr)
+                , m_size(0)
+            {}
+            CacheQueue(const CacheQueue& other) = delete;
+            CacheQueue& operator=(const CacheQueue& other) = delete;
+            int size() const { return m_size; }
+            bool isEmpty() const { return m_size == 0; }
+            ContainerObjectData<ValueType>* head() const { return m_head; }
+            void enqueue(ContainerObjectData<ValueType>* obj)
+            {
+                Q_ASSERT(obj && !obj->m_cachePrev && !obj->m_cacheNext && obj != m_head);
+                obj->m_cachePrev = m_tail;
+                if (m_tail)
+                    m_tail->m_cacheNext = obj;
+                else
+                    m_head = obj;
+                m_tail = obj;
+                ++m_size;
+            }
+            void prepend(ContainerObjectData<ValueType>* obj)
+            {
+                Q_ASSERT(obj && !obj->m_cachePrev && !obj->m_cacheNext && obj != m_head);
+                obj->m_cacheNext = m_head;
+                if (m_head)
+                    m_head->m_cachePrev = obj;
+                else
+                    m_tail = obj;
+                m_head = obj;
+                ++m_size;
+            }
+            void remove(ContainerObjectData<ValueType>* obj)
+            {
+                Q_ASSERT(obj && m_size > 0);
+                if (obj->m_cachePrev)
+                    obj->m_cachePrev->m_cacheNext = obj->m_cacheNext;
+                else
+                    m_head = obj->m_cacheNext;
+                if (obj->m_cacheNext)
+                    obj->m_cacheNext->m_cachePrev = obj->m_cachePrev;
+                else
+                    m_tail = obj->m_cachePrev;
+                obj->m_cachePrev = nullptr;
+                obj->m_cacheNext = nullptr;
+                --m_size;
+            }
+            void moveToBack(ContainerObjectData<ValueType>* obj)
+            {
+                if (obj == m_tail)
+                    return;
+                remove(obj);
+                enqueue(obj);
+            }
+            void clear()
+            {
+                while (m_head)
+                    remove(m_head);
+            }
+        };
+
+        // Keeps track of the cached values and of the ones recently evicted (ghosts) according to a CachePolicy
+        template <class ValueType>
+        class ValueCache
+        {
+            enum CacheList : quint8
+            {
+                NoList = 0
+                , RecentList // LRU, Clock, T1 in ARC, A1in in 2Q
+                , FrequentList // T2 in ARC, Am in 2Q
+                , RecentGhostList // B1 in ARC, A1out in 2Q
+                , FrequentGhostList // B2 in ARC
+                , PriorityList // LFU and GDSF
+            };
+            CachePolicy m_policy;
+            int m_capacity; // 0 means the number of values is not limited
+            int m_size;
+            qint64 m_bytes;
+            int m_target; // ARC target size of T1
+            double m_inflation; // GDSF inflation value L
+            double m_averageWeight; // GDSF weight used for values never read from disk
+            CacheQueue<ValueType> m_lists[PriorityList];
+            std::map<double, CacheQueue<ValueType> > m_priorityLists;
+            // Cached values handed out for writing, their size is measured again before it's needed
+            QSet<ContainerObjectData<ValueType>*> m_changedValues;
+            // Ghosts forgotten since the last takeDroppedGhosts()
+            QVector<ContainerObjectData<ValueType>*> m_droppedGhosts;
+
+            void link(ContainerObjectData<ValueType>* obj, CacheList list)
+            {
+                Q_ASSERT(obj->m_cacheList == NoList);
+                obj->m_cacheList = list;
+                if (list == PriorityList)
+                    m_priorityLists[obj->m_cachePriority].enqueue(obj);
+                else
+                    m_lists[list].enqueue(obj);
+                if (list != RecentGhostList && list != FrequentGhostList) {
+                    ++m_size;
+                    m_bytes += obj->m_cacheSize;
+                }
+            }
+            void unlink(ContainerObjectData<ValueType>* obj)
+            {
+                Q_ASSERT(obj->m_cacheList != NoList);
+                const CacheList list = static_cast<CacheList>(obj->m_cacheList);
+                if (list == PriorityList) {
+                    auto priorityIter = m_priorityLists.find(obj->m_cachePriority);
+                    Q_ASSERT(priorityIter != m_priorityLists.end());
+                    priorityIter->second.remove(obj);
+                    if (priorityIter->second.isEmpty())
+                        m_priorityLists.erase(priorityIter);
+                }
+                else {
+                    m_lists[list].remove(obj);
+                }
+                obj->m_cacheList = NoList;
+                if (!m_changedValues.isEmpty())
+                    m_changedValues.remove(obj);
+                if (list != RecentGhostList && list != FrequentGhostList) {
+                    --m_size;
+                    m_bytes -= obj->m_cacheSize;
+                }
+            }
+            int capacity() const
+            {
+                return m_capacity > 0 ? m_capacity : qMax(1, m_size);
+            }
+            void dropGhosts(CacheList list, int maxSize)
+            {
+                while (m_lists[list].size() > qMax(0, maxSize)) {
+                    m_droppedGhosts.append(m_lists[list].head());
+                    unlink(m_lists[list].head());
+                }
+            }
+            int arcTarget(const ContainerObjectData<ValueType>* incoming) const
+            {
+                if (!incoming)
+                    return m_target;
+                const int recentGhosts = m_lists[RecentGhostList].size();
+                const int frequentGhosts = m_lists[FrequentGhostList].size();
+                if (incoming->m_cacheList == RecentGhostList)
+                    return qMin(capacity(), m_target + qMax(1, frequentGhosts / recentGhosts));
+                if (incoming->m_cacheList == FrequentGhostList)
+                    return qMax(0, m_target - qMax(1, recentGhosts / frequentGhosts));
+                return m_target;
+            }
+            void setPriority(ContainerObjectData<ValueType>* obj)
+            {
+                if (m_policy == CachePolicy::LFU)
+                    obj->m_cachePriority = static_cast<double>(obj->m_cacheFrequency);
+                else
+                    obj->m_cachePriority = m_inflation + static_cast<double>(obj->m_cacheFrequency) * obj->m_cacheWeight;
+            }
+            QVector<ContainerObjectData<ValueType>*> cachedObjects() const
+            {
+                QVector<ContainerObjectData<ValueType>*> result;
+                result.reserve(m_size);
+                for (auto i = m_lists[RecentList].head(); i; i = i->m_cacheNext)
+                    result.append(i);
+                for (auto i = m_lists[FrequentList].head(); i; i = i->m_cacheNext)
+                    result.append(i);
+                for (auto j = m_priorityLists.cbegin(); j != m_priorityLists.cend(); ++j) {
+                    for (auto i = j->second.head(); i; i = i->m_cacheNext)
+                        result.append(i);
+                }
+                return result;
+            }
+        public:
+            ValueCache()
+                : m_policy(CachePolicy::LRU)
+                , m_capacity(1)
+                , m_size(0)
+                , m_bytes(0)
+                , m_target(0)
+                , m_inflation(0.0)
+                , m_averageWeight(1.0)
+            {}
+            ValueCache(const ValueCache& other) = delete;
+            ValueCache& operator=(const ValueCache& other) = delete;
+            // Copies the state of other replacing its objects with the ones in objectMap
+            void copyFrom(const ValueCache& other, const QHash<const ContainerObjectData<ValueType>*, ContainerObjectData<ValueType>*>& objectMap)
+            {
+                clear();
+                m_policy = other.m_policy;
+                m_capacity = other.m_capacity;
+                m_target = other.m_target;
+                m_inflation = other.m_inflation;
+                m_averageWeight = other.m_averageWeight;
+                for (int list = RecentList; list < PriorityList; ++list) {
+                    for (auto i = other.m_lists[list].head(); i; i = i->m_cacheNext)
+                        link(objectMap.value(i), static_cast<CacheList>(list));
+                }
+                for (auto j = other.m_priorityLists.cbegin(); j != other.m_priorityLists.cend(); ++j) {
+                    for (auto i = j->second.head(); i; i = i->m_cacheNext)
+                        link(objectMap.value(i), PriorityList);
+                }
+                for (auto i = other.m_changedValues.cbegin(); i != other.m_changedValues.cend(); ++i)
+                    m_changedValues.insert(objectMap.value(*i));
+            }
+            CachePolicy policy() const { return m_policy; }
+            void setPolicy(CachePolicy val)
+            {
+                if (val == m_policy)
+                    return;
+                const auto cached = cachedObjects();
+                const auto changed = m_changedValues;
+                dropGhosts(RecentGhostList, 0);
+                dropGhosts(FrequentGhostList, 0);
+                clear();
+                m_policy = val;
+                for (auto obj : cached)
+                    insert(obj);
+                m_changedValues = changed;
+            }
+            void setCapacity(int val)
+            {
+                m_capacity = qMax(0, val);
+                m_target = qMin(m_target, capacity());
+            }
+            int size() const { return m_size; }
+            // Total of the sizes of the cached objects
+            qint64 bytes() const { return m_bytes; }
+            void setSize(ContainerObjectData<ValueType>* obj, qint64 val)
+            {
+                if (obj->m_cacheList != NoList && obj->m_cacheList != RecentGhostList && obj->m_cacheList != FrequentGhostList)
+                    m_bytes += val - obj->m_cacheSize;
+                obj->m_cacheSize = val;
+            }
+            template <class SizeFunction>
+            void updateSizes(SizeFunction sizeOf)
+            {
+                m_changedValues.clear();
+                const auto cached = cachedObjects();
+                for (auto obj : cached)
+                    setSize(obj, sizeOf(*(obj->m_val)));
+            }
+            // The value of obj may be modified by the caller
+            void markChanged(ContainerObjectData<ValueType>* obj)
+            {
+                Q_ASSERT(obj->m_cacheList != NoList && obj->m_cacheList != RecentGhostList && obj->m_cacheList != FrequentGhostList);
+                m_changedValues.insert(obj);
+            }
+            template <class SizeFunction>
+            void updateChangedSizes(SizeFunction sizeOf)
+            {
+                if (m_changedValues.isEmpty())
+                    return;
+                const auto changed = m_changedValues;
+                m_changedValues.clear();
+                for (auto obj : changed)
+                    setSize(obj, sizeOf(*(obj->m_val)));
+            }
+            bool isEmpty() const { return m_size == 0; }
+            // Returns true if the object is cached or remembered as recently evicted
+            bool contains(const ContainerObjectData<ValueType>* obj) const { return obj->m_cacheList != NoList; }
+            // Returns true if the object is cached, ghosts excluded
+            bool isCached(const ContainerObjectData<ValueType>* obj) const
+            {
+                return obj->m_cacheList != NoList && obj->m_cacheList != RecentGhostList && obj->m_cacheList != FrequentGhostList;
+            }
+            // obj just became available in memory, it might be a ghost
+            void insert(ContainerObjectData<ValueType>* obj)
+            {
+                Q_ASSERT(obj->isAvailable());
+                switch (m_policy) {
+                case CachePolicy::ARC:
+                    if (obj->m_cacheList == RecentGhostList || obj->m_cacheList == FrequentGhostList) {
+                        m_target = arcTarget(obj);
+                        unlink(obj);
+                        link(obj, FrequentList);
+                    }
+                    else {
+                        link(obj, RecentList);
+                        dropGhosts(RecentGhostList, capacity() - m_lists[RecentList].size());
+                        dropGhosts(FrequentGhostList, 2 * capacity() - m_size - m_lists[RecentGhostList].size());
+                    }
+                    break;
+                case CachePolicy::TwoQueue:
+                    if (obj->m_cacheList == RecentGhostList) {
+                        unlink(obj);
+                        link(obj, FrequentList);
+                    }
+                    else {
+                        link(obj, RecentList);
+                    }
+                    dropGhosts(RecentGhostList, qMax(1, capacity() / 2));
+                    break;
+                case CachePolicy::LFU:
+                case CachePolicy::GDSF:
+                    Q_ASSERT(obj->m_cacheList == NoList);
+                    if (obj->m_cacheWeight > 0.0)
+                        m_averageWeight += (obj->m_cacheWeight - m_averageWeight) / 8.0;
+                    else
+                        obj->m_cacheWeight = m_averageWeight;
+                    obj->m_cacheFrequency = 1;
+                    setPriority(obj);
+                    link(obj, PriorityList);
+                    break;
+                default:
+                    Q_ASSERT(obj->m_cacheList == NoList);
+                    obj->m_cacheFrequency = 0;
+                    link(obj, RecentList);
+                    break;
+                }
+            }
+            // obj was read while cached
+            void touch(ContainerObjectData<ValueType>* obj)
+            {
+                Q_ASSERT(obj->isAvailable());
+                switch (m_policy) {
+                case CachePolicy::Clock:
+                    obj->m_cacheFrequency = 1;
+                    break;
+                case CachePolicy::LFU:
+                case CachePolicy::GDSF:
+                    unlink(obj);
+                    ++obj->m_cacheFrequency;
+                    setPriority(obj);
+                    link(obj, PriorityList);
+                    break;
+                case CachePolicy::ARC:
+                    unlink(obj);
+                    link(obj, FrequentList);
+                    break;
+                case CachePolicy::TwoQueue:
+                    if (obj->m_cacheList == FrequentList)
+                        m_lists[FrequentList].moveToBack(obj);
+                    break;
+                default:
+                    m_lists[RecentList].moveToBack(obj);
+                    break;
+                }
+            }
+            // Removes the value to write to disk from the cache. incoming is the object about to be cached, if known
+            ContainerObjectData<ValueType>* takeVictim(const ContainerObjectData<ValueType>* incoming = nullptr)
+            {
+                Q_ASSERT(m_size > 0);
+                ContainerObjectData<ValueType>* result = nullptr;
+                switch (m_policy) {
+                case CachePolicy::Clock:
+                    for (result = m_lists[RecentList].head(); result->m_cacheFrequency > 0; result = m_lists[RecentList].head()) {
+                        result->m_cacheFrequency = 0;
+                        m_lists[RecentList].moveToBack(result);
+                    }
+                    unlink(result);
+                    break;
+                case CachePolicy::LFU:
+                case CachePolicy::GDSF:
+                    result = m_priorityLists.begin()->second.head();
+                    if (m_policy == CachePolicy::GDSF)
+                        m_inflation = result->m_cachePriority;
+                    unlink(result);
+                    break;
+                case CachePolicy::ARC: {
+                    const int recentSize = m_lists[RecentList].size();
+                    const int target = arcTarget(incoming);
+                    if (m_lists[FrequentList].isEmpty() || (recentSize > 0 && (recentSize > target || (recentSize == target && incoming && incoming->m_cacheList == FrequentGhostList)))) {
+                        result = m_lists[RecentList].head();
+                        unlink(result);
+                        link(result, RecentGhostList);
+                    }
+                    else {
+                        result = m_lists[FrequentList].head();
+                        unlink(result);
+                        link(result, FrequentGhostList);
+                    }
+                    break;
+                }
+                case CachePolicy::TwoQueue:
+                    if (m_lists[FrequentList].isEmpty() || m_lists[RecentList].size() > qMax(1, capacity() / 4)) {
+                        result = m_lists[RecentList].head();
+                        unlink(result);
+                        link(result, RecentGhostList);
+                    }
+                    else {
+                        result = m_lists[FrequentList].head();
+                        unlink(result);
+                    }
+                    break;
+                default:
+                    result = m_lists[RecentList].head();
+                    unlink(result);
+                    break;
+                }
+                Q_ASSERT(result && result->isAvailable());
+                return result;
+            }
+            // Puts back a value returned by takeVictim that could not be written
+            void restore(ContainerObjectData<ValueType>* obj)
+            {
+                Q_ASSERT(obj->isAvailable());
+                if (obj->m_cacheList != NoList)
+                    unlink(obj);
+                if (m_policy == CachePolicy::LFU || m_policy == CachePolicy::GDSF) {
+                    link(obj, PriorityList);
+                    return;
+                }
+                link(obj, RecentList);
+                m_lists[RecentList].remove(obj);
+                m_lists[RecentList].prepend(obj);
+            }
+            void remove(ContainerObjectData<ValueType>* obj)
+            {
+                if (obj->m_cacheList != NoList)
+                    unlink(obj);
+            }
+            // The objects no longer tracked as ghosts since the last call
+            QVector<ContainerObjectData<ValueType>*> takeDroppedGhosts()
+            {
+                QVector<ContainerObjectData<ValueType>*> result;
+                result.swap(m_droppedGhosts);
+                return result;
+            }
+            void clear()
+            {
+                for (int list = RecentList; list < PriorityList; ++list) {
+                    while (!m_lists[list].isEmpty())
+                        unlink(m_lists[list].head());
+                }
+                while (!m_priorityLists.empty())
+                    unlink(m_priorityLists.begin()->second.head());
+                Q_ASSERT(m_size == 0 && m_bytes == 0);
+                m_droppedGhosts.clear();
+                m_target = 0;
+                m_inflation = 0.0;
+            }
+        };
+
+        // Values evicted from the cache waiting to be written to the file by a background thread.
+        // The queue never modifies the objects, the results of the writes are collected by the container
+        template <class ValueType>
+        class WriteBehindQueue
         {
-            QExplicitlySharedDataPointer<ContainerObjectData<ValueType> > m_d;
         public:
-            explicit ContainerObject(qint64 fPos)
-                :m_d(new ContainerObjectData<ValueType>(fPos))
+            // Position and size of a block written in the file, the position is -1 if the write failed
+            using WriteResult = QPair<qint64, int>;
+            // Serializes the value and writes it in the file, in place of the block at the given position if it fits
+            using WriteFunction = std::function<WriteResult(const ValueType&, int compressionLevel, qint64 slot, double headroom)>;
+        private:
+            struct PendingWrite
+            {
+                ContainerObjectData<ValueType>* m_object;
+                qint64 m_bytes;
+                int m_compressionLevel;
+                qint64 m_slot;
+                double m_headroom;
+            };
+            class WriterThread : public QThread
+            {
+                WriteBehindQueue* m_queue;
+            protected:
+                void run() Q_DECL_OVERRIDE { m_queue->processWrites(); }
+            public:
+                explicit WriterThread(WriteBehindQueue* queue)
+                    : QThread()
+                    , m_queue(queue)
+                {}
+            };
+            WriteFunction m_write;
+            qint64 m_maxBytes;
+            qint64 m_bytes;
+            // Blocks written by the thread, values queued without a size are assumed to be as large as their average
+            qint64 m_writtenBytes;
+            qint64 m_writtenBlocks;
+            bool m_stopping;
+            const ContainerObjectData<ValueType>* m_current;
+            std::list<PendingWrite> m_pending;
+            QHash<const ContainerObjectData<ValueType>*, typename std::list<PendingWrite>::iterator> m_pendingIndex;
+            QHash<ContainerObjectData<ValueType>*, WriteResult> m_finished;
+            QMutex m_mutex;
+            QWaitCondition m_changed;
+            std::unique_ptr<WriterThread> m_thread;
+
+            void processWrites()
+            {
+                QMutexLocker locker(&m_mutex);
+                for (;;) {
+                    while (m_pending.empty() && !m_stopping)
+                        m_changed.wait(&m_mutex);
+                    if (m_pending.empty())
+                        return;
+                    const PendingWrite current = m_pending.front();
+                    m_pending.pop_front();
+                    m_pendingIndex.remove(current.m_object);
+                    m_current = current.m_object;
+                    locker.unlock();
+                    const WriteResult result = m_write(*(current.m_object->m_val), current.m_compressionLevel, current.m_slot, current.m_headroom);
+                    locker.relock();
+                    m_current = nullptr;
+                    m_bytes -= current.m_bytes;
+                    if (result.first >= 0) {
+                        m_writtenBytes += result.second;
+                        ++m_writtenBlocks;
+                    }
+                    m_finished.insert(current.m_object, result);
+                    m_changed.wakeAll();
+                }
+            }
+        public:
+            explicit WriteBehindQueue(const WriteFunction& writeFunction)
+                : m_write(writeFunction)
+                , m_maxBytes(0)
+                , m_bytes(0)
+                , m_writtenBytes(0)
+                , m_writtenBlocks(0)
+                , m_stopping(false)
+                , m_current(nullptr)
             {}
+            WriteBehindQueue(const WriteBehindQueue& other) = delete;
+            WriteBehindQueue& operator=(const WriteBehindQueue& other) = delete;
+            ~WriteBehindQueue()
+            {
+                clear();
+                if (!m_thread)
+                    return;
+                {
+                    QMutexLocker locker(&m_mutex);
+                    m_stopping = true;
+                    m_changed.wakeAll();
+                }
+                m_thread->wait();
+            }
+            // The queue is only used if the limit is greater than 0
+            bool isEnabled() const { return m_maxBytes > 0; }
+            qint64 maxBytes() const { return m_maxBytes; }
+            void setMaxBytes(qint64 val) { m_maxBytes = val; }
+            // Queues obj for writing, blocks while the queued values exceed maxBytes().
+            // If bytes is negative the value is counted as large as the average block written so far
+            void enqueue(ContainerObjectData<ValueType>* obj, qint64 bytes, int compressionLevel, double headroom)
+            {
+                Q_ASSERT(obj->isAvailable());
+                QMutexLocker locker(&m_mutex);
+                if (bytes < 0)
+                    bytes = m_writtenBlocks > 0 ? qMax(Q_INT64_C(1), m_writtenBytes / m_writtenBlocks) : 1;
+                m_pending.push_back(PendingWrite{ obj, bytes, compressionLevel, obj->m_fPos, headroom });
+                m_pendingIndex.insert(obj, std::prev(m_pending.end()));
+                m_bytes += bytes;
+                if (!m_thread) {
+                    m_thread = std::make_unique<WriterThread>(this);
+                    m_thread->start();
+                }
+                m_changed.wakeAll();
+                while (m_bytes > m_maxBytes)
+                    m_changed.wait(&m_mutex);
+            }
+            // Removes obj from the queue waiting for it if it's being written.
+            // Returns the block the value was written to, with position -1 if it was not written
+            WriteResult take(ContainerObjectData<ValueType>* obj)
+            {
+                QMutexLocker locker(&m_mutex);
+                for (;;) {
+                    const auto pendingIter = m_pendingIndex.find(obj);
+                    if (pendingIter != m_pendingIndex.end()) {
+                        m_bytes -= pendingIter.value()->m_bytes;
+                        m_pending.erase(pendingIter.value());
+                        m_pendingIndex.erase(pendingIter);
+                        m_changed.wakeAll();
+                        return WriteResult(-1, -1);
+                    }
+                    const auto finishedIter = m_finished.find(obj);
+                    if (finishedIter != m_finished.end()) {
+                        const WriteResult result = finishedIter.value();
+                        m_finished.erase(finishedIter);
+                        return result;
+                    }
+                    Q_ASSERT(m_current == obj);
+                    m_changed.wait(&m_mutex);
+                }
+            }
+            // Returns the objects written since the last call and their blocks
+            QHash<ContainerObjectData<ValueType>*, WriteResult> takeFinished()
+            {
+                QMutexLocker locker(&m_mutex);
+                QHash<ContainerObjectData<ValueType>*, WriteResult> result;
+                result.swap(m_finished);
+                return result;
+            }
+            // Waits for all the queued values to be written
+            void flush()
+            {
+                QMutexLocker locker(&m_mutex);
+                while (!m_pending.empty() || m_current)
+                    m_changed.wait(&m_mutex);
+            }
+            // Discards the queued values and the results not collected yet
+            void clear()
+            {
+                QMutexLocker locker(&m_mutex);
+                for (auto i = m_pending.cbegin(); i != m_pending.cend(); ++i)
+                    m_bytes -= i->m_bytes;
+                m_pending.clear();
+                m_pendingIndex.clear();
+                while (m_current)
+                    m_changed.wait(&m_mutex);
+                m_finished.clear();
+                m_changed.wakeAll();
+            }
+        };
+
+        // Entry of the index, 16 bytes. Items whose value is only in the file keep its block in the entry
+        // without allocating anything, the others point to their shared data and m_fSize is SharedEntry
+        template <class ValueType>
+        class ContainerObject
+        {
+            using DataPointer = QExplicitlySharedDataPointer<ContainerObjectData<ValueType> >;
+            enum : qint32 { SharedEntry = std::numeric_limits<qint32>::min() };
+            union {
+                qint64 m_fPos;
+                DataPointer m_d;
+            };
+            qint32 m_fSize;
+            bool isShared() const { return m_fSize == SharedEntry; }
+            // Moves the block of a flat entry to newly allocated data
+            void share()
+            {
+                if (isShared())
+                    return;
+                new (&m_d) DataPointer(new ContainerObjectData<ValueType>(m_fPos, m_fSize));
+                m_fSize = SharedEntry;
+            }
+            void setFlat(qint64 fp, int fs)
+            {
+                if (isShared())
+                    m_d.~DataPointer();
+                m_fPos = fp;
+                m_fSize = fs;
+            }
+        public:
+            ContainerObject(qint64 fPos, int fSize)
+                :m_fPos(fPos)
+                , m_fSize(fSize)
+            {
+                Q_ASSERT(fPos >= 0 && fSize >= 0);
+            }
             explicit ContainerObject(ValueType* val)
                 :m_d(new ContainerObjectData<ValueType>(val))
+                , m_fSize(SharedEntry)
+            {}
+            explicit ContainerObject(const QByteArray& inlineBlock)
+                :m_d(new ContainerObjectData<ValueType>(inlineBlock))
+                , m_fSize(SharedEntry)
             {}
-            ContainerObject(const ContainerObject& other) = default;
-            bool isAvailable() const { return m_d->m_isAvailable; }
-            qint64 fPos() const { return m_d->m_data.m_fPos; }
-            const ValueType* val() const { Q_ASSERT(m_d->m_isAvailable); return m_d->m_data.m_val; }
-            ValueType* val() { Q_ASSERT(m_d->m_isAvailable); m_d.detach(); return m_d->m_data.m_val; }
-            void setFPos(qint64 fp)
+            ContainerObject(const ContainerObject& other)
+                :m_fSize(other.m_fSize)
             {
-                if (!m_d->m_isAvailable && m_d->m_data.m_fPos == fp)
+                if (isShared())
+                    new (&m_d) DataPointer(other.m_d);
+                else
+                    m_fPos = other.m_fPos;
+            }
+            ContainerObject& operator=(const ContainerObject& other)
+            {
+                if (!other.isShared())
+                    setFlat(other.m_fPos, other.m_fSize);
+                else if (isShared())
+                    m_d = other.m_d;
+                else {
+                    new (&m_d) DataPointer(other.m_d);
+                    m_fSize = SharedEntry;
+                }
+                return *this;
+            }
+            ~ContainerObject()
+            {
+                if (isShared())
+                    m_d.~DataPointer();
+            }
+            // nullptr for flat entries
+            ContainerObjectData<ValueType>* data() const { return isShared() ? m_d.data() : nullptr; }
+            void detach() { share(); m_d.detach(); }
+            bool isAvailable() const { return isShared() && m_d->isAvailable(); }
+            bool isDirty() const { return isShared() && m_d->isDirty(); }
+            bool isWriting() const { return isShared() && m_d->m_isWriting; }
+            qint64 fPos() const { return isShared() ? m_d->m_fPos : m_fPos; }
+            int fSize() const { return isShared() ? m_d->m_fSize : m_fSize; }
+            // The file holds an up to date copy of the value, or the item holds it inline
+            bool hasFileCopy() const { return fSize() >= 0; }
+            bool isInline() const { return isShared() && m_d->isInline(); }
+            const QByteArray& inlineBlock() const { Q_ASSERT(isInline()); return m_d->m_inline; }
+            // The block in the file, if any, must have been freed already
+            void setInline(const QByteArray& block)
+            {
+                detach();
+                m_d->setInline(block);
+            }
+            const ValueType* val() const { Q_ASSERT(isAvailable()); return m_d->m_val; }
+            ValueType* val() { Q_ASSERT(isAvailable()); m_d.detach(); return m_d->m_val; }
+            // The value must not be tracked by the cache, ghost queues included. fp is -1 to keep the inline copy.
+            // Shared entries stay shared, flatten() releases their data once nothing else points to it
+            void setFPos(qint64 fp, int fs)
+            {
+                Q_ASSERT(fs >= 0);
+                if (!isShared()) {
+                    Q_ASSERT(fp >= 0);
+                    setFlat(fp, fs);
+                    return;
+                }
+                Q_ASSERT(!m_d->m_isWriting && !m_d->isTracked());
+                if (!m_d->isAvailable() && m_d->m_fPos == fp && m_d->m_fSize == fs)
                     return;
                 m_d.detach();
-                if (m_d->m_isAvailable)
-                    delete m_d->m_data.m_val;
-                m_d->m_data.m_fPos = fp;
-                m_d->m_isAvailable = false;
+                m_d->setFPos(fp, fs);
             }
-            void setVal(ValueType* vl)
+            // fs is the size of a copy of vl already in the block of the item, -1 if there is none. The block is kept either way
+            void setVal(ValueType* vl, int fs = -1)
             {
+                detach();
+                m_d->setVal(vl, fs);
+            }
+            // Moves the block in the file without touching the value held in memory, fp is -1 if the item no longer has a block
+            void relocate(qint64 fp, int fs)
+            {
+                Q_ASSERT(fp >= 0 || fs < 0);
+                if (!isShared()) {
+                    m_fPos = fp;
+                    m_fSize = fs;
+                    return;
+                }
+                if (m_d->m_fPos == fp && m_d->m_fSize == fs)
+                    return;
                 m_d.detach();
-                if (m_d->m_isAvailable)
-                    delete m_d->m_data.m_val;
-                m_d->m_data.m_val = vl;
-                m_d->m_isAvailable = true;
+                m_d->m_fPos = fp;
+                m_d->m_fSize = fs;
+                m_d->m_inline.clear();
+            }
+            // The copy in the file is no longer valid, its block is kept so the value can be written back in place
+            void markDirty()
+            {
+                if (fSize() < 0)
+                    return;
+                detach();
+                m_d->m_fSize = -1;
+                m_d->m_inline.clear();
+            }
+            // Turns the entry back into a flat one if its value is only in the file. Returns true if the entry was changed
+            bool flatten()
+            {
+                if (!isShared() || m_d->isAvailable() || m_d->m_isWriting || m_d->isTracked() || m_d->m_fPos < 0)
+                    return false;
+                setFlat(m_d->m_fPos, m_d->m_fSize);
+                return true;
             }
         };
 
-        template <class KeyType, class ValueType, bool sorted>
-        class HugeContainerData : public QSharedData
+        // Ordered index of HugeMap, a B+tree with linked leaves that keeps keys and values in arrays inside the nodes.
+        // Nodes less than a quarter full after an erase are refilled or merged. Iterators are invalidated by insertions and removals of other keys
+        template <class Key, class T>
+        class SortedIndex
         {
-        public:
-            using ItemMapType = typename std::conditional<sorted, QMap<KeyType, ContainerObject<ValueType> >, QHash<KeyType, ContainerObject<ValueType> > >::type;
-            std::unique_ptr<ItemMapType> m_itemsMap;
-            std::unique_ptr<QMap<qint64, bool> > m_memoryMap;
-            std::unique_ptr<QTemporaryFile> m_device;
-            std::unique_ptr<QQueue<KeyType> > m_cache;
-            int m_maxCache;
-            int m_compressionLevel;
-            HugeContainerData()
-                : QSharedData()
-                , m_device(std::make_unique<QTemporaryFile>(QDir::tempPath() + QDir::separator() + QStringLiteral("HugeContainerDataXXXXXX")))
-                , m_cache(std::make_unique<QQueue<KeyType> >())
-                , m_memoryMap(std::make_unique<QMap<qint64, bool> >())
-                , m_itemsMap(std::make_unique<ItemMapType>())
-                , m_maxCache(1)
-                , m_compressionLevel(0)
+            enum { LeafCapacity = 32, InnerCapacity = 64, MinLeafCount = LeafCapacity / 4, MinInnerCount = InnerCapacity / 4, MaxHeight = 32 };
+            // Integral keys are searched by counting the smaller keys of the whole node instead of a binary search
+            using IntegralKeys = std::integral_constant<bool, std::is_integral<Key>::value>;
+            template <class X, int size>
+            struct RawArray
             {
-                if (!m_device->open())
-                    Q_ASSERT_X(false, "HugeContainer::HugeContainer", "Unable to create a temporary file");
-                m_memoryMap->insert(0, true);
+                typename std::aligned_storage<sizeof(X), alignof(X)>::type m_data[size];
+                X* items() { return reinterpret_cast<X*>(m_data); }
+                const X* items() const { return reinterpret_cast<const X*>(m_data); }
+            };
+            struct Node {};
+            struct Leaf : public Node
+            {
+                int m_count;
+                Leaf* m_prev;
+                Leaf* m_next;
+                RawArray<Key, LeafCapacity> m_keys;
+                RawArray<T, LeafCapacity> m_values;
+                Leaf()
+                    : m_count(0)
+                    , m_prev(nullptr)
+                    , m_next(nullptr)
+                {}
+                ~Leaf()
+                {
+                    destroyItems(m_keys.items(), m_count);
+                    destroyItems(m_values.items(), m_count);
+                }
+            };
+            // Child i holds the keys not smaller than key i-1 and smaller than key i
+            struct Inner : public Node
+            {
+                int m_count;
+                RawArray<Key, InnerCapacity - 1> m_keys;
+                Node* m_children[InnerCapacity];
+                Inner()
+                    : m_count(0)
+                {}
+                ~Inner()
+                {
+                    destroyItems(m_keys.items(), m_count - 1);
+                }
+            };
+            Node* m_root;
+            // Number of inner levels, the root is a leaf if it's 0
+            int m_height;
+            int m_size;
+            Leaf* m_firstLeaf;
+            Leaf* m_lastLeaf;
+
+            template <class X>
+            static void destroyItems(X* items, int count)
+            {
+                for (int i = 0; i < count; ++i)
+                    items[i].~X();
+            }
+            // Moves count items from src to the uninitialized dst, they must not overlap
+            template <class X>
+            static void moveItems(X* dst, X* src, int count)
+            {
+                for (int i = 0; i < count; ++i) {
+                    new (dst + i) X(std::move(src[i]));
+                    src[i].~X();
+                }
+            }
+            // Moves the items from pos to count one place forward leaving pos uninitialized
+            template <class X>
+            static void openGap(X* items, int count, int pos)
+            {
+                for (int i = count; i > pos; --i) {
+                    new (items + i) X(std::move(items[i - 1]));
+                    items[i - 1].~X();
+                }
+            }
+            // Destroys the item at pos and moves the following ones back
+            template <class X>
+            static void closeGap(X* items, int count, int pos)
+            {
+                items[pos].~X();
+                for (int i = pos + 1; i < count; ++i) {
+                    new (items + i - 1) X(std::move(items[i]));
+                    items[i].~X();
+                }
+            }
+            // Keys don't need to be assignable
+            template <class X, class Y>
+            static void replaceItem(X& item, Y&& val)
+            {
+                item.~X();
+                new (&item) X(std::forward<Y>(val));
+            }
+            // Number of keys smaller than key, or not greater than it if orEqual. Keys of 32 bits are compared four at a time
+            // with SSE2, the others by a loop without branches that is left to the compiler to vectorize
+            template <bool orEqual>
+            static int countKeys(const Key* keys, int count, const Key& key)
+            {
+                int result = 0;
+                int i = 0;
+#ifdef HUGECONTAINERS_SSE2
+                if (sizeof(Key) == 4) {
+                    // Unsigned keys are offset so the signed comparisons order them
+                    const __m128i offset = _mm_set1_epi32(std::is_signed<Key>::value ? 0 : std::numeric_limits<qint32>::min());
+                    const __m128i target = _mm_xor_si128(_mm_set1_epi32(static_cast<qint32>(static_cast<quint32>(key))), offset);
+                    // Each lane counts down by one for every matching key
+                    __m128i counts = _mm_setzero_si128();
+                    for (; i + 4 <= count; i += 4) {
+                        const __m128i block = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), offset);
+                        counts = _mm_add_epi32(counts, orEqual ? _mm_cmpgt_epi32(block, target) : _mm_cmplt_epi32(block, target));
+                    }
+                    counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(1, 0, 3, 2)));
+                    counts = _mm_add_epi32(counts, _mm_shuffle_epi32(counts, _MM_SHUFFLE(2, 3, 0, 1)));
+                    result = orEqual ? i + _mm_cvtsi128_si32(counts) : -_mm_cvtsi128_si32(counts);
+                }
+#endif
+                for (; i < count; ++i)
+                    result += (orEqual ? !(key < keys[i]) : keys[i] < key) ? 1 : 0;
+                return result;
+            }
+            // Number of keys smaller than key
+            static int lowerIndex(const Key* keys, int count, const Key& key, std::true_type)
+            {
+                return countKeys<false>(keys, count, key);
+            }
+            static int lowerIndex(const Key* keys, int count, const Key& key, std::false_type)
+            {
+                return static_cast<int>(std::lower_bound(keys, keys + count, key) - keys);
+            }
+            // Number of keys not greater than key
+            static int upperIndex(const Key* keys, int count, const Key& key, std::true_type)
+            {
+                return countKeys<true>(keys, count, key);
+            }
+            static int upperIndex(const Key* keys, int count, const Key& key, std::false_type)
+            {
+                return static_cast<int>(std::upper_bound(keys, keys + count, key) - keys);
+            }
+            // Finds the leaf that holds key or where it should be inserted. path and slots receive the inner nodes
+            // visited and the child taken in each, starting from the parent of the leaf
+            Leaf* findLeaf(const Key& key, Inner** path = nullptr, int* slots = nullptr) const
+            {
+                Node* node = m_root;
+                for (int level = m_height - 1; level >= 0; --level) {
+                    Inner* const inner = static_cast<Inner*>(node);
+                    const int slot = upperIndex(inner->m_keys.items(), inner->m_count - 1, key, IntegralKeys());
+                    if (path) {
+                        path[level] = inner;
+                        slots[level] = slot;
+                    }
+                    node = inner->m_children[slot];
+                }
+                return static_cast<Leaf*>(node);
+            }
+            // Adds child after the child in slot of the inner node at level of path, key is the smallest key in child
+            void insertChild(Inner** path, int* slots, int level, const Key& key, Node* child, bool append)
+            {
+                if (level == m_height) {
+                    Inner* const root = new Inner;
+                    root->m_children[0] = m_root;
+                    root->m_children[1] = child;
+                    new (root->m_keys.items()) Key(key);
+                    root->m_count = 2;
+                    m_root = root;
+                    Q_ASSERT(m_height < MaxHeight - 1);
+                    ++m_height;
+                    return;
+                }
+                Inner* inner = path[level];
+                int slot = slots[level] + 1;
+                if (inner->m_count < InnerCapacity) {
+                    openGap(inner->m_keys.items(), inner->m_count - 1, slot - 1);
+                    new (inner->m_keys.items() + slot - 1) Key(key);
+                    openGap(inner->m_children, inner->m_count, slot);
+                    inner->m_children[slot] = child;
+                    ++inner->m_count;
+                    return;
+                }
+                // Appending at the end of the tree only moves the last child of the full node, so no node has a single child
+                Inner* const right = new Inner;
+                if (append) {
+                    right->m_children[0] = inner->m_children[InnerCapacity - 1];
+                    right->m_children[1] = child;
+                    new (right->m_keys.items()) Key(key);
+                    right->m_count = 2;
+                    const Key separator(std::move(inner->m_keys.items()[InnerCapacity - 2]));
+                    inner->m_keys.items()[InnerCapacity - 2].~Key();
+                    inner->m_count = InnerCapacity - 1;
+                    insertChild(path, slots, level + 1, separator, right, append);
+                    return;
+                }
+                const int half = InnerCapacity / 2;
+                moveItems(right->m_keys.items(), inner->m_keys.items() + half, InnerCapacity - 1 - half);
+                moveItems(right->m_children, inner->m_children + half, InnerCapacity - half);
+                right->m_count = InnerCapacity - half;
+                // Key half-1 separates the two nodes
+                const Key separator(std::move(inner->m_keys.items()[half - 1]));
+                inner->m_keys.items()[half - 1].~Key();
+                inner->m_count = half;
+                if (slot > half) {
+                    inner = right;
+                    slot -= half;
+                }
+                openGap(inner->m_keys.items(), inner->m_count - 1, slot - 1);
+                new (inner->m_keys.items() + slot - 1) Key(key);
+                openGap(inner->m_children, inner->m_count, slot);
+                inner->m_children[slot] = child;
+                ++inner->m_count;
+                insertChild(path, slots, level + 1, separator, right, append);
+            }
+            // Moves the items of right to the end of left and deletes right
+            void mergeLeaves(Leaf* left, Leaf* right)
+            {
+                Q_ASSERT(left->m_count + right->m_count <= LeafCapacity && left->m_next == right);
+                moveItems(left->m_keys.items() + left->m_count, right->m_keys.items(), right->m_count);
+                moveItems(left->m_values.items() + left->m_count, right->m_values.items(), right->m_count);
+                left->m_count += right->m_count;
+                right->m_count = 0;
+                left->m_next = right->m_next;
+                if (right->m_next)
+                    right->m_next->m_prev = left;
+                else
+                    m_lastLeaf = left;
+                delete right;
+            }
+            // Refills the leaf in slot of path[0] from a neighbour or merges them. leaf and pos are moved along with the item they point to
+            void rebalanceLeaf(Inner** path, int* slots, Leaf*& leaf, int& pos)
+            {
+                Inner* const parent = path[0];
+                const int slot = slots[0];
+                Key* const separators = parent->m_keys.items();
+                Q_ASSERT(parent->m_count > 1 && parent->m_children[slot] == leaf);
+                if (slot > 0) {
+                    Leaf* const left = static_cast<Leaf*>(parent->m_children[slot - 1]);
+                    if (left->m_count > MinLeafCount) {
+                        const int last = --left->m_count;
+                        openGap(leaf->m_keys.items(), leaf->m_count, 0);
+                        new (leaf->m_keys.items()) Key(std::move(left->m_keys.items()[last]));
+                        left->m_keys.items()[last].~Key();
+                        openGap(leaf->m_values.items(), leaf->m_count, 0);
+                        new (leaf->m_values.items()) T(std::move(left->m_values.items()[last]));
+                        left->m_values.items()[last].~T();
+                        ++leaf->m_count;
+                        ++pos;
+                        replaceItem(separators[slot - 1], leaf->m_keys.items()[0]);
+                        return;
+                    }
+                    pos += left->m_count;
+                    mergeLeaves(left, leaf);
+                    leaf = left;
+                    removeChild(path, slots, 0);
+                    return;
+                }
+                Leaf* const right = static_cast<Leaf*>(parent->m_children[1]);
+                if (right->m_count > MinLeafCount) {
+                    new (leaf->m_keys.items() + leaf->m_count) Key(std::move(right->m_keys.items()[0]));
+                    new (leaf->m_values.items() + leaf->m_count) T(std::move(right->m_values.items()[0]));
+                    ++leaf->m_count;
+                    closeGap(right->m_keys.items(), right->m_count, 0);
+                    closeGap(right->m_values.items(), right->m_count, 0);
+                    --right->m_count;
+                    replaceItem(separators[0], right->m_keys.items()[0]);
+                    return;
+                }
+                mergeLeaves(leaf, right);
+                slots[0] = 1;
+                removeChild(path, slots, 0);
+            }
+            // Moves separator and the keys and children of right to the end of left and deletes right
+            static void mergeInners(Inner* left, Inner* right, const Key& separator)
+            {
+                Q_ASSERT(left->m_count + right->m_count <= InnerCapacity);
+                new (left->m_keys.items() + left->m_count - 1) Key(separator);
+                moveItems(left->m_keys.items() + left->m_count, right->m_keys.items(), right->m_count - 1);
+                moveItems(left->m_children + left->m_count, right->m_children, right->m_count);
+                left->m_count += right->m_count;
+                // Its keys were all moved
+                right->m_count = 1;
+                delete right;
+            }
+            // Refills path[level] from a neighbour or merges them
+            void rebalanceInner(Inner** path, int* slots, int level)
+            {
+                Inner* const inner = path[level];
+                Inner* const parent = path[level + 1];
+                const int slot = slots[level + 1];
+                Key* const separators = parent->m_keys.items();
+                Q_ASSERT(parent->m_count > 1 && parent->m_children[slot] == inner);
+                if (slot > 0) {
+                    Inner* const left = static_cast<Inner*>(parent->m_children[slot - 1]);
+                    if (left->m_count > MinInnerCount) {
+                        // The separator comes down to inner and the last key of left goes up
+                        openGap(inner->m_keys.items(), inner->m_count - 1, 0);
+                        new (inner->m_keys.items()) Key(std::move(separators[slot - 1]));
+                        replaceItem(separators[slot - 1], std::move(left->m_keys.items()[left->m_count - 2]));
+                        left->m_keys.items()[left->m_count - 2].~Key();
+                        openGap(inner->m_children, inner->m_count, 0);
+                        inner->m_children[0] = left->m_children[left->m_count - 1];
+                        --left->m_count;
+                        ++inner->m_count;
+                        return;
+                    }
+                    mergeInners(left, inner, separators[slot - 1]);
+                    removeChild(path, slots, level + 1);
+                    return;
+                }
+                Inner* const right = static_cast<Inner*>(parent->m_children[1]);
+                if (right->m_count > MinInnerCount) {
+                    // The separator comes down to inner and the first key of right goes up
+                    new (inner->m_keys.items() + inner->m_count - 1) Key(std::move(separators[0]));
+                    replaceItem(separators[0], std::move(right->m_keys.items()[0]));
+                    closeGap(right->m_keys.items(), right->m_count - 1, 0);
+                    inner->m_children[inner->m_count] = right->m_children[0];
+                    closeGap(right->m_children, right->m_count, 0);
+                    --right->m_count;
+                    ++inner->m_count;
+                    return;
+                }
+                mergeInners(inner, right, separators[0]);
+                slots[level + 1] = 1;
+                removeChild(path, slots, level + 1);
+            }
+            // Removes the child in slot of the inner node at level of path along with the key before it,
+            // the child must have been deleted already
+            void removeChild(Inner** path, int* slots, int level)
+            {
+                Inner* const inner = path[level];
+                const int slot = slots[level];
+                Q_ASSERT(slot > 0);
+                closeGap(inner->m_keys.items(), inner->m_count - 1, slot - 1);
+                closeGap(inner->m_children, inner->m_count, slot);
+                --inner->m_count;
+                if (level < m_height - 1) {
+                    if (inner->m_count < MinInnerCount)
+                        rebalanceInner(path, slots, level);
+                    return;
+                }
+                // A root with a single child is replaced by the child
+                if (inner->m_count == 1) {
+                    m_root = inner->m_children[0];
+                    delete inner;
+                    --m_height;
+                }
+            }
+            void deleteNode(Node* node, int level)
+            {
+                if (level == 0) {
+                    delete static_cast<Leaf*>(node);
+                    return;
+                }
+                Inner* const inner = static_cast<Inner*>(node);
+                for (int i = 0; i < inner->m_count; ++i)
+                    deleteNode(inner->m_children[i], level - 1);
+                delete inner;
+            }
+            void reset()
+            {
+                Leaf* const root = new Leaf;
+                m_root = root;
+                m_height = 0;
+                m_size = 0;
+                m_firstLeaf = root;
+                m_lastLeaf = root;
+            }
+        public:
+            class const_iterator;
+            class iterator
+            {
+                friend class SortedIndex;
+                friend class const_iterator;
+                const SortedIndex* m_index;
+                Leaf* m_leaf;
+                int m_pos;
+                iterator(const SortedIndex* index, Leaf* leaf, int pos)
+                    : m_index(index)
+                    , m_leaf(leaf)
+                    , m_pos(pos)
+                {
+                    // An iterator past the last key of a leaf points to the first one of the next
+                    if (m_leaf && m_pos == m_leaf->m_count) {
+                        m_leaf = m_leaf->m_next;
+                        m_pos = 0;
+                    }
+                }
+            public:
+                using iterator_category = std::bidirectional_iterator_tag;
+                using difference_type = qptrdiff;
+                using value_type = T;
+                using pointer = T*;
+                using reference = T&;
+                iterator()
+                    : m_index(nullptr)
+                    , m_leaf(nullptr)
+                    , m_pos(0)
+                {}
+                const Key& key() const { return m_leaf->m_keys.items()[m_pos]; }
+                T& value() const { return m_leaf->m_values.items()[m_pos]; }
+                T& operator*() const { return value(); }
+                T* operator->() const { return &value(); }
+                iterator& operator++()
+                {
+                    if (++m_pos == m_leaf->m_count) {
+                        m_leaf = m_leaf->m_next;
+                        m_pos = 0;
+                    }
+                    return *this;
+                }
+                iterator operator++(int) { iterator result(*this); operator++(); return result; }
+                iterator& operator--()
+                {
+                    if (!m_leaf) {
+                        m_leaf = m_index->m_lastLeaf;
+                        m_pos = m_leaf->m_count;
+                    }
+                    else if (m_pos == 0) {
+                        m_leaf = m_leaf->m_prev;
+                        m_pos = m_leaf->m_count;
+                    }
+                    --m_pos;
+                    return *this;
+                }
+                iterator operator--(int) { iterator result(*this); operator--(); return result; }
+                iterator& operator+=(int j)
+                {
+                    for (; j > 0; --j)
+                        operator++();
+                    for (; j < 0; ++j)
+                        operator--();
+                    return *this;
+                }
+                iterator& operator-=(int j) { return operator+=(-j); }
+                iterator operator+(int j) const { iterator result(*this); result += j; return result; }
+                iterator operator-(int j) const { iterator result(*this); result -= j; return result; }
+                bool operator==(const iterator& other) const { return m_leaf == other.m_leaf && m_pos == other.m_pos; }
+                bool operator!=(const iterator& other) const { return !operator==(other); }
+            };
+            class const_iterator
+            {
+                iterator m_base;
+            public:
+                using iterator_category = std::bidirectional_iterator_tag;
+                using difference_type = qptrdiff;
+                using value_type = T;
+                using pointer = const T*;
+                using reference = const T&;
+                const_iterator() = default;
+                const_iterator(const iterator& base)
+                    : m_base(base)
+                {}
+                const Key& key() const { return m_base.key(); }
+                const T& value() const { return m_base.value(); }
+                const T& operator*() const { return value(); }
+                const T* operator->() const { return &value(); }
+                const_iterator& operator++() { ++m_base; return *this; }
+                const_iterator operator++(int) { const_iterator result(*this); ++m_base; return result; }
+                const_iterator& operator--() { --m_base; return *this; }
+                const_iterator operator--(int) { const_iterator result(*this); --m_base; return result; }
+                const_iterator& operator+=(int j) { m_base += j; return *this; }
+                const_iterator& operator-=(int j) { m_base -= j; return *this; }
+                const_iterator operator+(int j) const { return const_iterator(m_base + j); }
+                const_iterator operator-(int j) const { return const_iterator(m_base - j); }
+                bool operator==(const const_iterator& other) const { return m_base == other.m_base; }
+                bool operator!=(const const_iterator& other) const { return !operator==(other); }
+            };
+            SortedIndex()
+            {
+                reset();
+            }
+            SortedIndex(const SortedIndex& other)
+            {
+                reset();
+                for (auto i = other.constBegin(); i != other.constEnd(); ++i)
+                    insert(i.key(), i.value());
+            }
+            SortedIndex& operator=(const SortedIndex& other)
+            {
+                if (this != &other) {
+                    clear();
+                    for (auto i = other.constBegin(); i != other.constEnd(); ++i)
+                        insert(i.key(), i.value());
+                }
+                return *this;
+            }
+            ~SortedIndex()
+            {
+                deleteNode(m_root, m_height);
+            }
+            int size() const { return m_size; }
+            int count() const { return m_size; }
+            bool isEmpty() const { return m_size == 0; }
+            void clear()
+            {
+                deleteNode(m_root, m_height);
+                reset();
+            }
+            iterator begin() { return iterator(this, m_firstLeaf, 0); }
+            iterator end() { return iterator(this, nullptr, 0); }
+            const_iterator begin() const { return constBegin(); }
+            const_iterator end() const { return constEnd(); }
+            const_iterator constBegin() const { return iterator(this, m_firstLeaf, 0); }
+            const_iterator constEnd() const { return iterator(this, nullptr, 0); }
+            // First item whose key is not smaller than key
+            iterator lowerBound(const Key& key)
+            {
+                Leaf* const leaf = findLeaf(key);
+                return iterator(this, leaf, lowerIndex(leaf->m_keys.items(), leaf->m_count, key, IntegralKeys()));
+            }
+            const_iterator lowerBound(const Key& key) const { return const_cast<SortedIndex*>(this)->lowerBound(key); }
+            // First item whose key is greater than key
+            iterator upperBound(const Key& key)
+            {
+                Leaf* const leaf = findLeaf(key);
+                return iterator(this, leaf, upperIndex(leaf->m_keys.items(), leaf->m_count, key, IntegralKeys()));
+            }
+            const_iterator upperBound(const Key& key) const { return const_cast<SortedIndex*>(this)->upperBound(key); }
+            iterator find(const Key& key)
+            {
+                Leaf* const leaf = findLeaf(key);
+                const int pos = lowerIndex(leaf->m_keys.items(), leaf->m_count, key, IntegralKeys());
+                if (pos == leaf->m_count || key < leaf->m_keys.items()[pos])
+                    return end();
+                return iterator(this, leaf, pos);
+            }
+            const_iterator find(const Key& key) const { return constFind(key); }
+            const_iterator constFind(const Key& key) const { return const_cast<SortedIndex*>(this)->find(key); }
+            bool contains(const Key& key) const { return constFind(key) != constEnd(); }
+            // Replaces the value if key is already in the index
+            iterator insert(const Key& key, const T& value)
+            {
+                Inner* path[MaxHeight];
+                int slots[MaxHeight];
+                Leaf* leaf = findLeaf(key, path, slots);
+                int pos = lowerIndex(leaf->m_keys.items(), leaf->m_count, key, IntegralKeys());
+                if (pos < leaf->m_count && !(key < leaf->m_keys.items()[pos])) {
+                    leaf->m_values.items()[pos] = value;
+                    return iterator(this, leaf, pos);
+                }
+                if (leaf->m_count == LeafCapacity) {
+                    Leaf* const right = new Leaf;
+                    right->m_prev = leaf;
+                    right->m_next = leaf->m_next;
+                    if (leaf->m_next)
+                        leaf->m_next->m_prev = right;
+                    else
+                        m_lastLeaf = right;
+                    leaf->m_next = right;
+                    // Appending at the end of the tree leaves the full leaf as it is
+                    const bool append = right == m_lastLeaf && pos == LeafCapacity;
+                    if (append) {
+                        new (right->m_keys.items()) Key(key);
+                        new (right->m_values.items()) T(value);
+                        right->m_count = 1;
+                        ++m_size;
+                        insertChild(path, slots, 0, key, right, true);
+                        return iterator(this, right, 0);
+                    }
+                    const int half = LeafCapacity / 2;
+                    moveItems(right->m_keys.items(), leaf->m_keys.items() + half, LeafCapacity - half);
+                    moveItems(right->m_values.items(), leaf->m_values.items() + half, LeafCapacity - half);
+                    right->m_count = LeafCapacity - half;
+                    leaf->m_count = half;
+                    insertChild(path, slots, 0, right->m_keys.items()[0], right, false);
+                    if (pos > half) {
+                        leaf = right;
+                        pos -= half;
+                    }
+                }
+                openGap(leaf->m_keys.items(), leaf->m_count, pos);
+                new (leaf->m_keys.items() + pos) Key(key);
+                openGap(leaf->m_values.items(), leaf->m_count, pos);
+                new (leaf->m_values.items() + pos) T(value);
+                ++leaf->m_count;
+                ++m_size;
+                return iterator(this, leaf, pos);
+            }
+            // Returns the item following the erased one
+            iterator erase(iterator it)
+            {
+                Q_ASSERT(it.m_leaf);
+                Inner* path[MaxHeight];
+                int slots[MaxHeight];
+                Leaf* leaf = findLeaf(it.key(), path, slots);
+                Q_ASSERT(leaf == it.m_leaf);
+                int pos = it.m_pos;
+                closeGap(leaf->m_keys.items(), leaf->m_count, pos);
+                closeGap(leaf->m_values.items(), leaf->m_count, pos);
+                --leaf->m_count;
+                --m_size;
+                if (m_height > 0 && leaf->m_count < MinLeafCount)
+                    rebalanceLeaf(path, slots, leaf, pos);
+                return iterator(this, leaf, pos);
+            }
+            int remove(const Key& key)
+            {
+                const iterator it = find(key);
+                if (it == end())
+                    return 0;
+                erase(it);
+                return 1;
+            }
+            QList<Key> keys() const
+            {
+                QList<Key> result;
+                result.reserve(m_size);
+                for (auto i = constBegin(); i != constEnd(); ++i)
+                    result.append(i.key());
+                return result;
+            }
+            QList<Key> uniqueKeys() const { return keys(); }
+        };
+
+        // Unordered index of HugeHash, an open addressing table probed in groups of 16 slots whose control bytes, 7 bits of the hash
+        // or an empty or deleted marker, are compared at once. Insertions move a few slots of the old table after a rehash.
+        // Iterators are invalidated by insertions of new keys
+        template <class Key, class T>
+        class HashIndex
+        {
+            enum : qint8 { EmptySlot = -128, DeletedSlot = -2 };
+            enum { GroupSize = 16 };
+            // Slots of the old table moved by each insertion while rehashing
+            enum { MigrationStep = 4 * GroupSize };
+            struct Slot
+            {
+                Key m_key;
+                T m_value;
+            };
+
+            static quint64 hashOf(const Key& key)
+            {
+                const quint64 result = static_cast<quint64>(qHash(key)) * Q_UINT64_C(0x9E3779B97F4A7C15);
+                return result ^ (result >> 29);
+            }
+            static qint8 fragmentOf(quint64 hash) { return static_cast<qint8>(hash & 0x7F); }
+            // Bit i is set if control byte i of the group is byte
+            static quint32 matchByte(const qint8* group, qint8 byte)
+            {
+#ifdef HUGECONTAINERS_SSE2
+                const __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+                return static_cast<quint32>(_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte))));
+#else
+                quint32 result = 0;
+                for (int i = 0; i < GroupSize; ++i)
+                    result |= static_cast<quint32>(group[i] == byte) << i;
+                return result;
+#endif
+            }
+            // Bit i is set if slot i of the group is empty or deleted
+            static quint32 matchFree(const qint8* group)
+            {
+#ifdef HUGECONTAINERS_SSE2
+                const __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+                return static_cast<quint32>(_mm_movemask_epi8(_mm_cmplt_epi8(control, _mm_set1_epi8(-1))));
+#else
+                quint32 result = 0;
+                for (int i = 0; i < GroupSize; ++i)
+                    result |= static_cast<quint32>(group[i] < -1) << i;
+                return result;
+#endif
+            }
+            struct Table
+            {
+                // m_capacity + GroupSize control bytes, the last group repeats the first so any group can be read at once
+                qint8* m_control;
+                Slot* m_slots;
+                // 0 or a power of 2 not smaller than GroupSize
+                int m_capacity;
+                // Keys that can be added to empty slots before the table must grow, it's kept under 7/8 full
+                int m_growthLeft;
+
+                void setControl(int pos, qint8 control)
+                {
+                    m_control[pos] = control;
+                    if (pos < GroupSize)
+                        m_control[pos + m_capacity] = control;
+                }
+                // Slot holding key, -1 if there is none
+                int findSlot(const Key& key, quint64 hash) const
+                {
+                    if (m_capacity == 0)
+                        return -1;
+                    const qint8 fragment = fragmentOf(hash);
+                    const int mask = m_capacity - 1;
+                    int pos = static_cast<int>((hash >> 7) & static_cast<quint64>(mask));
+                    for (int step = GroupSize;; step += GroupSize) {
+                        const qint8* const group = m_control + pos;
+                        for (quint32 match = matchByte(group, fragment); match; match &= match - 1) {
+                            const int slot = (pos + static_cast<int>(qCountTrailingZeroBits(match))) & mask;
+                            if (m_slots[slot].m_key == key)
+                                return slot;
+                        }
+                        if (matchByte(group, EmptySlot))
+                            return -1;
+                        pos = (pos + step) & mask;
+                    }
+                }
+                // First empty or deleted slot in the probe sequence of hash
+                int freeSlot(quint64 hash) const
+                {
+                    const int mask = m_capacity - 1;
+                    int pos = static_cast<int>((hash >> 7) & static_cast<quint64>(mask));
+                    for (int step = GroupSize;; step += GroupSize) {
+                        const quint32 match = matchFree(m_control + pos);
+                        if (match)
+                            return (pos + static_cast<int>(qCountTrailingZeroBits(match))) & mask;
+                        pos = (pos + step) & mask;
+                    }
+                }
+                // Moves or copies the item in a free slot
+                template <class S>
+                int place(quint64 hash, S&& item)
+                {
+                    const int slot = freeSlot(hash);
+                    if (m_control[slot] == EmptySlot)
+                        --m_growthLeft;
+                    setControl(slot, fragmentOf(hash));
+                    new (m_slots + slot) Slot(std::forward<S>(item));
+                    return slot;
+                }
+                // First slot in use from pos on, -1 if there is none
+                int nextSlot(int pos) const
+                {
+                    for (; pos < m_capacity; pos += GroupSize) {
+                        quint32 used = ~matchFree(m_control + pos) & 0xFFFF;
+                        if (m_capacity - pos < GroupSize)
+                            used &= (1u << (m_capacity - pos)) - 1;
+                        if (used)
+                            return pos + static_cast<int>(qCountTrailingZeroBits(used));
+                    }
+                    return -1;
+                }
+                // Last slot in use before pos, -1 if there is none
+                int previousSlot(int pos) const
+                {
+                    while (--pos >= 0 && m_control[pos] < 0) {}
+                    return pos;
+                }
+                void allocate(int capacity)
+                {
+                    m_capacity = capacity;
+                    m_control = new qint8[capacity + GroupSize];
+                    std::fill(m_control, m_control + capacity + GroupSize, static_cast<qint8>(EmptySlot));
+                    m_slots = static_cast<Slot*>(::operator new(sizeof(Slot) * static_cast<size_t>(capacity)));
+                    m_growthLeft = capacity - capacity / 8;
+                }
+                void release()
+                {
+                    if (m_capacity == 0)
+                        return;
+                    for (int i = nextSlot(0); i >= 0; i = nextSlot(i + 1))
+                        m_slots[i].~Slot();
+                    delete[] m_control;
+                    ::operator delete(m_slots);
+                    m_control = nullptr;
+                    m_slots = nullptr;
+                    m_capacity = 0;
+                    m_growthLeft = 0;
+                }
+            };
+            Table m_table;
+            // Table being emptied into m_table while rehashing, its capacity is 0 otherwise
+            Table m_oldTable;
+            // Slots of m_oldTable before this one were already moved
+            int m_migrated;
+            int m_size;
+
+            // Positions from m_table.m_capacity on are slots of m_oldTable
+            Slot& slotAt(int pos) const
+            {
+                return pos < m_table.m_capacity ? m_table.m_slots[pos] : m_oldTable.m_slots[pos - m_table.m_capacity];
+            }
+            int findSlot(const Key& key) const
+            {
+                const quint64 hash = hashOf(key);
+                const int slot = m_table.findSlot(key, hash);
+                if (slot >= 0 || m_oldTable.m_capacity == 0)
+                    return slot;
+                const int oldSlot = m_oldTable.findSlot(key, hash);
+                return oldSlot < 0 ? -1 : m_table.m_capacity + oldSlot;
+            }
+            // First slot in use from pos on, -1 if there is none
+            int nextSlot(int pos) const
+            {
+                if (pos < m_table.m_capacity) {
+                    const int slot = m_table.nextSlot(pos);
+                    if (slot >= 0)
+                        return slot;
+                    pos = m_table.m_capacity;
+                }
+                const int oldSlot = m_oldTable.nextSlot(pos - m_table.m_capacity);
+                return oldSlot < 0 ? -1 : m_table.m_capacity + oldSlot;
+            }
+            // Last slot in use before pos, or before the end if pos is -1
+            int previousSlot(int pos) const
+            {
+                if (pos < 0)
+                    pos = m_table.m_capacity + m_oldTable.m_capacity;
+                if (pos > m_table.m_capacity) {
+                    const int oldSlot = m_oldTable.previousSlot(pos - m_table.m_capacity);
+                    if (oldSlot >= 0)
+                        return m_table.m_capacity + oldSlot;
+                    pos = m_table.m_capacity;
+                }
+                return m_table.previousSlot(pos);
+            }
+            // Moves up to count slots of the old table to the new one, releasing the old table once it's empty
+            void migrate(int count)
+            {
+                if (m_oldTable.m_capacity == 0)
+                    return;
+                const int last = count < m_oldTable.m_capacity - m_migrated ? m_migrated + count : m_oldTable.m_capacity;
+                for (; m_migrated < last; ++m_migrated) {
+                    if (m_oldTable.m_control[m_migrated] < 0)
+                        continue;
+                    Slot& item = m_oldTable.m_slots[m_migrated];
+                    m_table.place(hashOf(item.m_key), std::move(item));
+                    item.~Slot();
+                    // The slot stays deleted so the keys still in the old table can be found
+                    m_oldTable.setControl(m_migrated, DeletedSlot);
+                }
+                if (m_migrated == m_oldTable.m_capacity)
+                    m_oldTable.release();
+            }
+            // Starts moving the keys to a table of the given capacity, dropping the deleted slots
+            void rehash(int capacity)
+            {
+                migrate(m_oldTable.m_capacity);
+                m_oldTable = m_table;
+                m_table.allocate(capacity);
+                m_migrated = 0;
+            }
+            void copyFrom(const HashIndex& other)
+            {
+                m_size = other.m_size;
+                if (other.m_table.m_capacity == 0)
+                    return;
+                m_table.allocate(other.m_table.m_capacity);
+                if (other.m_oldTable.m_capacity == 0) {
+                    std::copy(other.m_table.m_control, other.m_table.m_control + m_table.m_capacity + GroupSize, m_table.m_control);
+                    for (int i = other.m_table.nextSlot(0); i >= 0; i = other.m_table.nextSlot(i + 1))
+                        new (m_table.m_slots + i) Slot(other.m_table.m_slots[i]);
+                    m_table.m_growthLeft = other.m_table.m_growthLeft;
+                    return;
+                }
+                // The copy gets a single table, the new table of other has room for all its keys
+                for (int i = other.nextSlot(0); i >= 0; i = other.nextSlot(i + 1))
+                    m_table.place(hashOf(other.slotAt(i).m_key), other.slotAt(i));
+            }
+        public:
+            class const_iterator;
+            class iterator
+            {
+                friend class HashIndex;
+                friend class const_iterator;
+                const HashIndex* m_index;
+                // -1 past the end, so end() stays valid when the table is rehashed
+                int m_pos;
+                iterator(const HashIndex* index, int pos)
+                    : m_index(index)
+                    , m_pos(pos)
+                {}
+            public:
+                using iterator_category = std::bidirectional_iterator_tag;
+                using difference_type = qptrdiff;
+                using value_type = T;
+                using pointer = T*;
+                using reference = T&;
+                iterator()
+                    : m_index(nullptr)
+                    , m_pos(-1)
+                {}
+                const Key& key() const { return m_index->slotAt(m_pos).m_key; }
+                T& value() const { return m_index->slotAt(m_pos).m_value; }
+                T& operator*() const { return value(); }
+                T* operator->() const { return &value(); }
+                iterator& operator++() { m_pos = m_index->nextSlot(m_pos + 1); return *this; }
+                iterator operator++(int) { iterator result(*this); operator++(); return result; }
+                iterator& operator--() { m_pos = m_index->previousSlot(m_pos); return *this; }
+                iterator operator--(int) { iterator result(*this); operator--(); return result; }
+                iterator& operator+=(int j)
+                {
+                    for (; j > 0; --j)
+                        operator++();
+                    for (; j < 0; ++j)
+                        operator--();
+                    return *this;
+                }
+                iterator& operator-=(int j) { return operator+=(-j); }
+                iterator operator+(int j) const { iterator result(*this); result += j; return result; }
+                iterator operator-(int j) const { iterator result(*this); result -= j; return result; }
+                bool operator==(const iterator& other) const { return m_pos == other.m_pos; }
+                bool operator!=(const iterator& other) const { return !operator==(other); }
+            };
+            class const_iterator
+            {
+                iterator m_base;
+            public:
+                using iterator_category = std::bidirectional_iterator_tag;
+                using difference_type = qptrdiff;
+                using value_type = T;
+                using pointer = const T*;
+                using reference = const T&;
+                const_iterator() = default;
+                const_iterator(const iterator& base)
+                    : m_base(base)
+                {}
+                const Key& key() const { return m_base.key(); }
+                const T& value() const { return m_base.value(); }
+                const T& operator*() const { return value(); }
+                const T* operator->() const { return &value(); }
+                const_iterator& operator++() { ++m_base; return *this; }
+                const_iterator operator++(int) { const_iterator result(*this); ++m_base; return result; }
+                const_iterator& operator--() { --m_base; return *this; }
+                const_iterator operator--(int) { const_iterator result(*this); --m_base; return result; }
+                const_iterator& operator+=(int j) { m_base += j; return *this; }
+                const_iterator& operator-=(int j) { m_base -= j; return *this; }
+                const_iterator operator+(int j) const { return const_iterator(m_base + j); }
+                const_iterator operator-(int j) const { return const_iterator(m_base - j); }
+                bool operator==(const const_iterator& other) const { return m_base == other.m_base; }
+                bool operator!=(const const_iterator& other) const { return !operator==(other); }
+            };
+            HashIndex()
+                : m_table{ nullptr, nullptr, 0, 0 }
+                , m_oldTable{ nullptr, nullptr, 0, 0 }
+                , m_migrated(0)
+                , m_size(0)
+            {}
+            HashIndex(const HashIndex& other)
+                : HashIndex()
+            {
+                copyFrom(other);
+            }
+            HashIndex& operator=(const HashIndex& other)
+            {
+                if (this != &other) {
+                    clear();
+                    copyFrom(other);
+                }
+                return *this;
+            }
+            ~HashIndex()
+            {
+                clear();
+            }
+            int size() const { return m_size; }
+            int count() const { return m_size; }
+            bool isEmpty() const { return m_size == 0; }
+            void clear()
+            {
+                m_table.release();
+                m_oldTable.release();
+                m_migrated = 0;
+                m_size = 0;
+            }
+            // Makes room for size keys at once so inserting them doesn't rehash
+            void reserve(int size)
+            {
+                int capacity = GroupSize;
+                while (capacity - capacity / 8 < size && capacity < (1 << 30))
+                    capacity *= 2;
+                if (capacity <= m_table.m_capacity)
+                    return;
+                rehash(capacity);
+                migrate(m_oldTable.m_capacity);
+            }
+            iterator begin() { return iterator(this, nextSlot(0)); }
+            iterator end() { return iterator(this, -1); }
+            const_iterator begin() const { return constBegin(); }
+            const_iterator end() const { return constEnd(); }
+            const_iterator constBegin() const { return iterator(this, nextSlot(0)); }
+            const_iterator constEnd() const { return iterator(this, -1); }
+            iterator find(const Key& key)
+            {
+                const int slot = findSlot(key);
+                return slot < 0 ? end() : iterator(this, slot);
+            }
+            const_iterator find(const Key& key) const { return constFind(key); }
+            const_iterator constFind(const Key& key) const { return const_cast<HashIndex*>(this)->find(key); }
+            bool contains(const Key& key) const { return findSlot(key) >= 0; }
+            // Replaces the value if key is already in the index
+            iterator insert(const Key& key, const T& value)
+            {
+                const int existing = findSlot(key);
+                if (existing >= 0) {
+                    slotAt(existing).m_value = value;
+                    return iterator(this, existing);
+                }
+                migrate(MigrationStep);
+                if (m_table.m_growthLeft == 0) {
+                    // If deleted slots take most of the room the table is cleaned up instead of growing
+                    if (m_table.m_capacity == 0)
+                        m_table.allocate(GroupSize);
+                    else if (m_size < m_table.m_capacity / 2)
+                        rehash(m_table.m_capacity);
+                    else
+                        rehash(m_table.m_capacity * 2);
+                }
+                const int slot = m_table.place(hashOf(key), Slot{ key, value });
+                ++m_size;
+                return iterator(this, slot);
+            }
+            // Returns the item following the erased one, the other items are not moved
+            iterator erase(iterator it)
+            {
+                Q_ASSERT(it.m_pos >= 0 && it.m_pos < m_table.m_capacity + m_oldTable.m_capacity);
+                Table& table = it.m_pos < m_table.m_capacity ? m_table : m_oldTable;
+                const int slot = it.m_pos < m_table.m_capacity ? it.m_pos : it.m_pos - m_table.m_capacity;
+                Q_ASSERT(table.m_control[slot] >= 0);
+                table.m_slots[slot].~Slot();
+                table.setControl(slot, DeletedSlot);
+                --m_size;
+                return iterator(this, nextSlot(it.m_pos + 1));
+            }
+            int remove(const Key& key)
+            {
+                const int slot = findSlot(key);
+                if (slot < 0)
+                    return 0;
+                erase(iterator(this, slot));
+                return 1;
+            }
+            QList<Key> keys() const
+            {
+                QList<Key> result;
+                result.reserve(m_size);
+                for (auto i = constBegin(); i != constEnd(); ++i)
+                    result.append(i.key());
+                return result;
+            }
+            QList<Key> uniqueKeys() const { return keys(); }
+        };
+
+        template <class KeyType, class ValueType, bool sorted>
+        class HugeContainerData : public QSharedData
+        {
+        public:
+            using ItemMapType = typename std::conditional<sorted, SortedIndex<KeyType, ContainerObject<ValueType> >, HashIndex<KeyType, ContainerObject<ValueType> > >::type;
+            std::unique_ptr<ItemMapType> m_itemsMap;
+            std::unique_ptr<QMap<qint64, bool> > m_memoryMap;
+            // Free blocks of m_memoryMap, except the one at the end of the file, ordered by size and then by position
+            std::set<std::pair<qint64, qint64> > m_freeBlocks;
+            // Total size of m_freeBlocks
+            qint64 m_freeBytes;
+            std::unique_ptr<QTemporaryFile> m_device;
+            std::unique_ptr<ValueCache<ValueType> > m_cache;
+            int m_maxCache;
+            qint64 m_maxCacheBytes;
+            std::function<qint64(const ValueType&)> m_valueSizeFunction;
+            int m_compressionLevel;
+            int m_readAhead;
+            // Values whose serialized form takes at most this many bytes are kept inline in their item instead of the file. 0 if disabled
+            int m_inlineSize;
+            // Extra space reserved after each block written, as a fraction of its size, so the value can grow and still be written in place
+            double m_slotHeadroom;
+            // Fragmentation at which the automatic compaction starts and stops, it's disabled if m_compactionHigh is 0
+            double m_compactionHigh;
+            double m_compactionLow;
+            qint64 m_compactionMinSize;
+            qint64 m_compactionStep;
+            bool m_compacting;
+            // Free and used bytes of the file after the last automatic compaction step
+            qint64 m_compactionFreeMark;
+            qint64 m_compactionUsedMark;
+            // The automatic compaction or garbage collection after the last change could not move a block
+            bool m_maintenanceFailed;
+            // Values decoded ahead of sequential iterators, indexed by the position of their block in the file
+            QHash<qint64, ValueType> m_readAheadValues;
+            // If true blocks are read through a memory mapping of the file
+            bool m_memoryMapped;
+            uchar* m_mappedFile;
+            qint64 m_mappedSize;
+            bool m_unflushedWrites;
+            // Size of the file, the data ends at the last key of m_memoryMap and the rest is allocated in advance
+            qint64 m_fileCapacity;
+            // The file grows by multiples of this size, 0 to grow it by each block written
+            qint64 m_growthChunk;
+            // In log-structured mode blocks are always written at m_logHead and the file is split in segments of this size
+            // that are rewritten when their live data falls below m_segmentLiveRatio. 0 if disabled
+            qint64 m_segmentSize;
+            double m_segmentLiveRatio;
+            // Position of the free space the log continues from, -1 to pick a new free extent
+            qint64 m_logHead;
+            // Segment whose blocks are being moved, the log doesn't continue in it. -1 if none
+            qint64 m_collectedSegment;
+            // Bytes used by the blocks starting in each segment, segments without blocks are not listed
+            QHash<qint64, qint64> m_segmentLive;
+            // Segments whose live data fell below m_segmentLiveRatio
+            QSet<qint64> m_gcCandidates;
+            // Blocks of at most a quarter of m_pageSize bytes are packed together in pages of m_pageSize bytes. 0 if disabled
+            qint64 m_pageSize;
+            // Blocks stored in pages: position of the block -> space allocated to it
+            QMap<qint64, qint64> m_packedBlocks;
+            // Extents of m_memoryMap used as pages: position of the page -> size of its largest gap
+            QMap<qint64, qint64> m_pages;
+            // Pages ordered by the size of their largest gap and then by position
+            std::set<std::pair<qint64, qint64> > m_pageSpace;
+            // Keys of the items owning the blocks in the file, indexed by position. Only kept once compaction needed them, see trackOwners().
+            // Every block has a single owner, a multi map only avoids requiring KeyType to be assignable
+            bool m_ownersTracked;
+            QMultiMap<qint64, KeyType> m_blockOwners;
+            // Keys of the values in the cache, ghosts included. They become the owners of the blocks written
+            // and their items are turned flat when the values leave the cache
+            QMultiHash<const ContainerObjectData<ValueType>*, KeyType> m_cachedKeys;
+            // Freed ranges are released to the filesystem in multiples of this size, 0 if it's not supported
+            qint64 m_punchAlignment;
+            // Changes every time a block may be moved or overwritten, readers that release the container re-check it
+            quint64 m_fileGeneration;
+            // Protects the file and its layout: m_device, m_memoryMap, the free blocks, segments and pages and the block owners.
+            // Every function that reads or changes them, here or in HugeContainer, expects the caller to hold it
+            QMutex m_fileMutex;
+            // Declared last so the writer stops before anything it uses is destroyed
+            std::unique_ptr<WriteBehindQueue<ValueType> > m_writeQueue;
+            HugeContainerData()
+                : QSharedData()
+                , m_device(std::make_unique<QTemporaryFile>(QDir::tempPath() + QDir::separator() + QStringLiteral("HugeContainerDataXXXXXX")))
+                , m_cache(std::make_unique<ValueCache<ValueType> >())
+                , m_memoryMap(std::make_unique<QMap<qint64, bool> >())
+                , m_itemsMap(std::make_unique<ItemMapType>())
+                , m_freeBytes(0)
+                , m_maxCache(1)
+                , m_maxCacheBytes(0)
+                , m_compressionLevel(0)
+                , m_readAhead(32)
+                , m_inlineSize(0)
+                , m_slotHeadroom(0.0)
+                , m_compactionHigh(0.0)
+                , m_compactionLow(0.0)
+                , m_compactionMinSize(0)
+                , m_compactionStep(0)
+                , m_compacting(false)
+                , m_compactionFreeMark(0)
+                , m_compactionUsedMark(0)
+                , m_maintenanceFailed(false)
+                , m_memoryMapped(false)
+                , m_mappedFile(nullptr)
+                , m_mappedSize(0)
+                , m_unflushedWrites(false)
+                , m_fileCapacity(0)
+                , m_growthChunk(0)
+                , m_segmentSize(0)
+                , m_segmentLiveRatio(0.0)
+                , m_logHead(-1)
+                , m_collectedSegment(-1)
+                , m_pageSize(0)
+                , m_ownersTracked(false)
+                , m_punchAlignment(0)
+                , m_fileGeneration(0)
+                , m_writeQueue(createWriteQueue())
+            {
+                if (!m_device->open())
+                    Q_ASSERT_X(false, "HugeContainer::HugeContainer", "Unable to create a temporary file");
+                m_punchAlignment = filesystemBlockSize();
+                m_memoryMap->insert(0, true);
+            }
+            ~HugeContainerData() = default;
+            HugeContainerData(HugeContainerData& other)
+                : QSharedData(other)
+                , m_device(std::make_unique<QTemporaryFile>(QDir::tempPath() + QDir::separator() + QStringLiteral("HugeContainerDataXXXXXX")))
+                , m_cache(std::make_unique<ValueCache<ValueType> >())
+                , m_memoryMap(std::make_unique<QMap<qint64, bool> >())
+                , m_itemsMap(std::make_unique<ItemMapType>())
+                , m_freeBytes(0)
+                , m_maxCache(other.m_maxCache)
+                , m_maxCacheBytes(other.m_maxCacheBytes)
+                , m_valueSizeFunction(other.m_valueSizeFunction)
+                , m_compressionLevel(other.m_compressionLevel)
+                , m_readAhead(other.m_readAhead)
+                , m_inlineSize(other.m_inlineSize)
+                , m_slotHeadroom(other.m_slotHeadroom)
+                , m_compactionHigh(other.m_compactionHigh)
+                , m_compactionLow(other.m_compactionLow)
+                , m_compactionMinSize(other.m_compactionMinSize)
+                , m_compactionStep(other.m_compactionStep)
+                , m_compacting(false)
+                , m_compactionFreeMark(0)
+                , m_compactionUsedMark(0)
+                , m_maintenanceFailed(false)
+                , m_memoryMapped(other.m_memoryMapped)
+                , m_mappedFile(nullptr)
+                , m_mappedSize(0)
+                , m_unflushedWrites(false)
+                , m_fileCapacity(0)
+                , m_growthChunk(other.m_growthChunk)
+                , m_segmentSize(other.m_segmentSize)
+                , m_segmentLiveRatio(other.m_segmentLiveRatio)
+                , m_logHead(other.m_logHead)
+                , m_collectedSegment(-1)
+                , m_pageSize(other.m_pageSize)
+                , m_ownersTracked(false)
+                , m_punchAlignment(0)
+                , m_fileGeneration(0)
+                , m_writeQueue(createWriteQueue())
+            {
+                if (!m_device->open())
+                    Q_ASSERT_X(false, "HugeContainer::HugeContainer", "Unable to create a temporary file");
+                m_punchAlignment = filesystemBlockSize();
+                // Objects queued for writing can't be shared, their state changes when the write completes
+                other.settleWrites();
+                m_writeQueue->setMaxBytes(other.m_writeQueue->maxBytes());
+                *m_memoryMap = *(other.m_memoryMap);
+                m_freeBlocks = other.m_freeBlocks;
+                m_freeBytes = other.m_freeBytes;
+                m_segmentLive = other.m_segmentLive;
+                m_gcCandidates = other.m_gcCandidates;
+                m_packedBlocks = other.m_packedBlocks;
+                m_pages = other.m_pages;
+                m_pageSpace = other.m_pageSpace;
+                *m_itemsMap = *(other.m_itemsMap);
+                // The space allocated in advance is not copied
+                const qint64 totalSize = other.m_memoryMap->lastKey();
+                const qint64 chunkSize = 1 << 16;
+                for (qint64 copied = 0; copied < totalSize; copied += chunkSize) {
+                    if (!writeAt(copied, other.readAt(copied, qMin(chunkSize, totalSize - copied))))
+                        Q_ASSERT_X(false, "HugeContainer::HugeContainer", "Unable to copy the temporary file");
+                }
+                m_fileCapacity = totalSize;
+                // Objects tracked by the cache can't be shared as they are linked in its queues
+                QHash<const ContainerObjectData<ValueType>*, ContainerObjectData<ValueType>*> cachedObjects;
+                for (auto i = m_itemsMap->begin(); i != m_itemsMap->end(); ++i) {
+                    if (!i->data() || !other.m_cache->contains(i->data()))
+                        continue;
+                    const ContainerObjectData<ValueType>* const sharedObject = i->data();
+                    i->detach();
+                    cachedObjects.insert(sharedObject, i->data());
+                    m_cachedKeys.insert(i->data(), i.key());
+                }
+                m_cache->copyFrom(*(other.m_cache), cachedObjects);
+            }
+            std::unique_ptr<WriteBehindQueue<ValueType> > createWriteQueue()
+            {
+                return std::make_unique<WriteBehindQueue<ValueType> >([this](const ValueType& val, int compressionLevel, qint64 slot, double headroom) -> QPair<qint64, int> {
+                    const QByteArray block = serializeValue(val, compressionLevel);
+                    QMutexLocker fileLocker(&m_fileMutex);
+                    return qMakePair(rewriteInMap(slot, block, headroom), block.size());
+                });
+            }
+            // Values are stored as their bytes only if RawValueStorage opts them in, the others go through QDataStream
+            using RawValue = std::integral_constant<bool, RawValueStorage<ValueType>::value>;
+            static_assert(!RawValue::value || std::is_trivially_copyable<ValueType>::value, "RawValueStorage requires a trivially copyable type");
+            static QByteArray serializeValue(const ValueType& val, int compressionLevel)
+            {
+                return compressBlock(encodeValue(val), compressionLevel);
+            }
+            static QByteArray compressBlock(const QByteArray& block, int compressionLevel)
+            {
+                if (compressionLevel != 0)
+                    return qCompress(block, compressionLevel);
+                return block;
+            }
+            // Encodes val without compressing it
+            static QByteArray encodeValue(const ValueType& val)
+            {
+                return encodeValue(val, RawValue());
+            }
+            static QByteArray encodeValue(const ValueType& val, std::true_type)
+            {
+                return QByteArray(reinterpret_cast<const char*>(&val), static_cast<int>(sizeof(ValueType)));
+            }
+            static QByteArray encodeValue(const ValueType& val, std::false_type)
+            {
+                QByteArray block;
+                QDataStream writerStream(&block, QIODevice::WriteOnly);
+                writerStream << val;
+                return block;
+            }
+            // Decodes an uncompressed block into val, returns false if the block is not valid
+            static bool decodeValue(const QByteArray& block, ValueType& val)
+            {
+                return decodeValue(block, val, RawValue());
+            }
+            static bool decodeValue(const QByteArray& block, ValueType& val, std::true_type)
+            {
+                if (block.size() != static_cast<int>(sizeof(ValueType)))
+                    return false;
+                std::memcpy(&val, block.constData(), sizeof(ValueType));
+                return true;
+            }
+            static bool decodeValue(const QByteArray& block, ValueType& val, std::false_type)
+            {
+                if (block.isEmpty())
+                    return false;
+                QDataStream readerStream(block);
+                readerStream >> val;
+                return true;
+            }
+            // Writes block in the smallest free block of at least capacity bytes or at the end of the file.
+            // In log-structured mode it's written at the head of the log instead
+            qint64 writeInMap(const QByteArray& block, qint64 capacity = 0)
+            {
+                if (isPacked(qMax(capacity, static_cast<qint64>(block.size()))))
+                    return writeInPage(block, capacity);
+                if (m_segmentSize <= 0)
+                    return writeInExtent(bestFit(qMax(capacity, static_cast<qint64>(block.size()))), block, capacity);
+                // Blocks in the log are never rewritten in place so they get no headroom
+                const qint64 blockPos = writeInExtent(logExtent(block.size()), block);
+                if (blockPos >= 0)
+                    m_logHead = blockPos + block.size();
+                return blockPos;
+            }
+            // Position of the smallest hole of at least blockSize bytes, the end of the file if there is none
+            qint64 bestFit(qint64 blockSize) const
+            {
+                const auto freeIter = m_freeBlocks.lower_bound(std::make_pair(blockSize, Q_INT64_C(0)));
+                return freeIter == m_freeBlocks.end() ? m_memoryMap->lastKey() : freeIter->second;
+            }
+            // Writes block at the start of the free extent at blockPos, or at the end of the file, in a block of at least capacity bytes.
+            qint64 writeInExtent(qint64 blockPos, const QByteArray& block, qint64 capacity = 0)
+            {
+                if (!m_device->isWritable())
+                    return -1;
+                const qint64 blockSize = qMax(capacity, static_cast<qint64>(block.size()));
+                if (blockPos != m_memoryMap->lastKey()) {
+                    const qint64 freeSize = (m_memoryMap->constFind(blockPos) + 1).key() - blockPos;
+                    eraseFreeBlock(blockPos, freeSize);
+                    if (freeSize > blockSize) {
+                        // Item smaller than available space
+                        m_memoryMap->insert(blockPos + blockSize, true);
+                        insertFreeBlock(blockPos + blockSize, freeSize - blockSize);
+                    }
+                }
+                else {
+                    if (!growFile(blockPos + blockSize, blockPos + block.size()))
+                        return -1;
+                    m_memoryMap->insert(blockPos + blockSize, true);
+                }
+                m_memoryMap->insert(blockPos, false);
+                markUsed(blockPos, blockSize);
+                if (!writeAt(blockPos, block)) {
+                    freeInMap(blockPos);
+                    return -1;
+                }
+                return blockPos;
+            }
+            // Free space the log continues in: its head if the block fits there, else the smallest free extent of at least half a segment
+            // or the end of the file. The segment being collected is never picked
+            qint64 logExtent(qint64 blockSize) const
+            {
+                if (m_logHead >= 0 && m_logHead != m_memoryMap->lastKey() && !inCollectedSegment(m_logHead, blockSize)) {
+                    const auto headIter = m_memoryMap->constFind(m_logHead);
+                    if (headIter != m_memoryMap->constEnd() && headIter.value() && (headIter + 1).key() - m_logHead >= blockSize)
+                        return m_logHead;
+                }
+                for (auto freeIter = m_freeBlocks.lower_bound(std::make_pair(qMax(blockSize, m_segmentSize / 2), Q_INT64_C(0))); freeIter != m_freeBlocks.end(); ++freeIter) {
+                    if (!inCollectedSegment(freeIter->second, blockSize))
+                        return freeIter->second;
+                }
+                return m_memoryMap->lastKey();
+            }
+            // True if a block of blockSize bytes at pos would overlap the segment being collected
+            bool inCollectedSegment(qint64 pos, qint64 blockSize) const
+            {
+                if (m_collectedSegment < 0)
+                    return false;
+                const qint64 segmentStart = m_collectedSegment * m_segmentSize;
+                return pos < segmentStart + m_segmentSize && pos + blockSize > segmentStart;
+            }
+            // True if a block of blockSize bytes goes in a page. The log doesn't use pages
+            bool isPacked(qint64 blockSize) const
+            {
+                return m_pageSize > 0 && m_segmentSize <= 0 && blockSize > 0 && blockSize <= m_pageSize / 4;
+            }
+            // Writes block in the page with the smallest gap it fits in, in a block of at least capacity bytes.
+            // A new page is allocated if none has room
+            qint64 writeInPage(const QByteArray& block, qint64 capacity = 0)
+            {
+                const qint64 blockSize = qMax(capacity, static_cast<qint64>(block.size()));
+                qint64 pagePos;
+                const auto spaceIter = m_pageSpace.lower_bound(std::make_pair(blockSize, Q_INT64_C(0)));
+                const bool newPage = spaceIter == m_pageSpace.end();
+                if (!newPage) {
+                    pagePos = spaceIter->second;
+                }
+                else {
+                    pagePos = writeInExtent(bestFit(m_pageSize), QByteArray(), m_pageSize);
+                    if (pagePos < 0)
+                        return -1;
+                    m_pages.insert(pagePos, m_pageSize);
+                    m_pageSpace.insert(std::make_pair(m_pageSize, pagePos));
+                }
+                qint64 largestGap;
+                const qint64 blockPos = scanPage(pagePos, blockSize, largestGap);
+                Q_ASSERT(blockPos >= 0);
+                if (!writeAt(blockPos, block)) {
+                    if (newPage) {
+                        m_pageSpace.erase(std::make_pair(m_pageSize, pagePos));
+                        m_pages.remove(pagePos);
+                        freeInMap(pagePos);
+                    }
+                    return -1;
+                }
+                m_packedBlocks.insert(blockPos, blockSize);
+                scanPage(pagePos, 0, largestGap);
+                setPageSpace(pagePos, largestGap);
+                return blockPos;
+            }
+            // Returns the position of the first gap of at least blockSize bytes in the page at pagePos, -1 if there is none.
+            // largestGap is set to the size of the largest gap of the page
+            qint64 scanPage(qint64 pagePos, qint64 blockSize, qint64& largestGap) const
+            {
+                const qint64 pageEnd = pagePos + extentSize(pagePos);
+                qint64 result = -1;
+                qint64 gapStart = pagePos;
+                largestGap = 0;
+                for (auto i = m_packedBlocks.lowerBound(pagePos);; ++i) {
+                    const qint64 gapEnd = (i == m_packedBlocks.constEnd() || i.key() >= pageEnd) ? pageEnd : i.key();
+                    if (result < 0 && gapEnd - gapStart >= blockSize)
+                        result = gapStart;
+                    largestGap = qMax(largestGap, gapEnd - gapStart);
+                    if (gapEnd == pageEnd)
+                        return result;
+                    gapStart = i.key() + i.value();
+                }
+            }
+            void setPageSpace(qint64 pagePos, qint64 largestGap)
+            {
+                const auto pageIter = m_pages.find(pagePos);
+                Q_ASSERT(pageIter != m_pages.end());
+                m_pageSpace.erase(std::make_pair(pageIter.value(), pagePos));
+                pageIter.value() = largestGap;
+                m_pageSpace.insert(std::make_pair(largestGap, pagePos));
+            }
+            // Position of the page holding the packed block at pos
+            qint64 pageOf(qint64 pos) const
+            {
+                Q_ASSERT(m_packedBlocks.contains(pos));
+                const auto pageIter = m_pages.upperBound(pos);
+                Q_ASSERT(pageIter != m_pages.constBegin());
+                return (pageIter - 1).key();
+            }
+            // Start of the extent of m_memoryMap holding the block at pos
+            qint64 extentOf(qint64 pos) const
+            {
+                return m_packedBlocks.contains(pos) ? pageOf(pos) : pos;
+            }
+            // Frees the block at pos if it's in a page, the page itself is freed with its last block.
+            // Returns false if the block is not in a page
+            bool freeInPage(qint64 pos)
+            {
+                const auto blockIter = m_packedBlocks.find(pos);
+                if (blockIter == m_packedBlocks.end())
+                    return false;
+                const qint64 pagePos = pageOf(pos);
+                m_packedBlocks.erase(blockIter);
+                const qint64 pageEnd = pagePos + extentSize(pagePos);
+                const auto nextIter = m_packedBlocks.lowerBound(pagePos);
+                if (nextIter == m_packedBlocks.end() || nextIter.key() >= pageEnd) {
+                    m_pageSpace.erase(std::make_pair(m_pages.value(pagePos), pagePos));
+                    m_pages.remove(pagePos);
+                    freeInMap(pagePos);
+                    return true;
+                }
+                qint64 largestGap;
+                scanPage(pagePos, 0, largestGap);
+                setPageSpace(pagePos, largestGap);
+                return true;
+            }
+            // Updates the pages after the page of pageSize bytes at oldPos was moved to newPos
+            void relocatePage(qint64 oldPos, qint64 newPos, qint64 pageSize)
+            {
+                const qint64 pageEnd = oldPos + pageSize;
+                QVector<QPair<qint64, qint64> > blocks;
+                for (auto i = m_packedBlocks.lowerBound(oldPos); i != m_packedBlocks.end() && i.key() < pageEnd;) {
+                    blocks.append(qMakePair(i.key() - oldPos + newPos, i.value()));
+                    i = m_packedBlocks.erase(i);
+                }
+                for (auto i = blocks.cbegin(); i != blocks.cend(); ++i)
+                    m_packedBlocks.insert(i->first, i->second);
+                const qint64 largestGap = m_pages.take(oldPos);
+                m_pageSpace.erase(std::make_pair(largestGap, oldPos));
+                m_pages.insert(newPos, largestGap);
+                m_pageSpace.insert(std::make_pair(largestGap, newPos));
+            }
+            void clearPages()
+            {
+                m_packedBlocks.clear();
+                m_pages.clear();
+                m_pageSpace.clear();
+            }
+            // Track the live bytes of each segment in log-structured mode
+            void markUsed(qint64 pos, qint64 size)
+            {
+                if (m_segmentSize > 0)
+                    m_segmentLive[pos / m_segmentSize] += size;
+            }
+            void markFree(qint64 pos, qint64 size)
+            {
+                if (m_segmentSize <= 0)
+                    return;
+                const qint64 segment = pos / m_segmentSize;
+                const auto liveIter = m_segmentLive.find(segment);
+                Q_ASSERT(liveIter != m_segmentLive.end());
+                liveIter.value() -= size;
+                if (liveIter.value() <= 0) {
+                    m_segmentLive.erase(liveIter);
+                    m_gcCandidates.remove(segment);
+                }
+                else if (liveIter.value() < m_segmentLiveRatio * m_segmentSize) {
+                    m_gcCandidates.insert(segment);
+                }
+            }
+            void rebuildSegments()
+            {
+                m_segmentLive.clear();
+                m_gcCandidates.clear();
+                m_logHead = -1;
+                if (m_segmentSize <= 0)
+                    return;
+                for (auto i = m_memoryMap->constBegin(); i != m_memoryMap->constEnd(); ++i) {
+                    if (!i.value())
+                        markUsed(i.key(), (i + 1).key() - i.key());
+                }
+                for (auto i = m_segmentLive.constBegin(); i != m_segmentLive.constEnd(); ++i) {
+                    if (i.value() < m_segmentLiveRatio * m_segmentSize)
+                        m_gcCandidates.insert(i.key());
+                }
+            }
+            // Space allocated to the block at pos
+            qint64 slotCapacity(qint64 pos) const
+            {
+                const auto packedIter = m_packedBlocks.constFind(pos);
+                if (packedIter != m_packedBlocks.constEnd())
+                    return packedIter.value();
+                return extentSize(pos);
+            }
+            // Size of the used extent of m_memoryMap at pos
+            qint64 extentSize(qint64 pos) const
+            {
+                const auto fileIter = m_memoryMap->constFind(pos);
+                Q_ASSERT(fileIter != m_memoryMap->constEnd() && !fileIter.value());
+                return (fileIter + 1).key() - pos;
+            }
+            // Writes block in place of the block at slot if it fits, otherwise moves it to a new block with headroom and frees slot.
+            // slot is -1 if the value has no block yet
+            qint64 rewriteInMap(qint64 slot, const QByteArray& block, double headroom)
+            {
+                // The log is only appended to
+                if (slot >= 0 && m_segmentSize <= 0 && slotCapacity(slot) >= block.size())
+                    return writeAt(slot, block) ? slot : -1;
+                const qint64 result = writeInMap(block, block.size() + static_cast<qint64>(block.size() * headroom));
+                if (result >= 0 && slot >= 0)
+                    freeInMap(slot);
+                return result;
+            }
+            // Add and remove holes keeping m_freeBytes in sync
+            void insertFreeBlock(qint64 pos, qint64 size)
+            {
+                m_freeBlocks.insert(std::make_pair(size, pos));
+                m_freeBytes += size;
+            }
+            void eraseFreeBlock(qint64 pos, qint64 size)
+            {
+                Q_ASSERT(m_freeBlocks.count(std::make_pair(size, pos)) == 1);
+                m_freeBlocks.erase(std::make_pair(size, pos));
+                m_freeBytes -= size;
+            }
+            // Marks the block at pos as free, merging it with the free blocks next to it
+            void freeInMap(qint64 pos)
+            {
+                if (m_ownersTracked)
+                    m_blockOwners.remove(pos);
+                if (freeInPage(pos))
+                    return;
+                auto fileIter = m_memoryMap->find(pos);
+                Q_ASSERT(fileIter != m_memoryMap->end());
+                if (fileIter.value())
+                    return;
+                auto nextIter = fileIter + 1;
+                Q_ASSERT(nextIter != m_memoryMap->end());
+                const qint64 blockEnd = nextIter.key();
+                markFree(pos, blockEnd - pos);
+                if (nextIter.value()) {
+                    const auto afterIter = nextIter + 1;
+                    if (afterIter != m_memoryMap->end())
+                        eraseFreeBlock(nextIter.key(), afterIter.key() - nextIter.key());
+                    m_memoryMap->erase(nextIter);
+                }
+                if (fileIter != m_memoryMap->begin() && (fileIter - 1).value()) {
+                    const auto prevIter = fileIter - 1;
+                    eraseFreeBlock(prevIter.key(), fileIter.key() - prevIter.key());
+                    m_memoryMap->erase(fileIter);
+                    fileIter = prevIter;
+                }
+                else {
+                    fileIter.value() = true;
+                }
+                nextIter = fileIter + 1;
+                if (nextIter == m_memoryMap->end()) {
+                    shrinkFile(fileIter.key());
+                }
+                else {
+                    insertFreeBlock(fileIter.key(), nextIter.key() - fileIter.key());
+                    punchHole(pos, blockEnd, fileIter.key(), nextIter.key());
+                }
+            }
+            // Gives the filesystem blocks touched by the freed range [start, end) back to the filesystem if they are fully inside
+            // the hole [holeStart, holeEnd), the file keeps its size
+            void punchHole(qint64 start, qint64 end, qint64 holeStart, qint64 holeEnd)
+            {
+#ifdef Q_OS_LINUX
+                if (m_punchAlignment <= 0)
+                    return;
+                start = qMax(holeStart, start - start % m_punchAlignment);
+                end = qMin(holeEnd, end + m_punchAlignment - 1);
+                start += (m_punchAlignment - start % m_punchAlignment) % m_punchAlignment;
+                end -= end % m_punchAlignment;
+                if (end - start < m_punchAlignment)
+                    return;
+                if (::fallocate(m_device->handle(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(start), static_cast<off_t>(end - start)) != 0 && errno == EOPNOTSUPP)
+                    m_punchAlignment = 0; // Not supported by the filesystem, don't try again
+#else
+                Q_UNUSED(start);
+                Q_UNUSED(end);
+                Q_UNUSED(holeStart);
+                Q_UNUSED(holeEnd);
+#endif
+            }
+            // Space the file takes on the disk
+            qint64 diskUsage() const
+            {
+#ifdef Q_OS_UNIX
+                struct stat fileStat;
+                if (::fstat(m_device->handle(), &fileStat) == 0)
+                    return static_cast<qint64>(fileStat.st_blocks) * 512;
+#endif
+                return m_device->size();
+            }
+            // Size of the blocks of the filesystem holding the file, 0 if holes can't be punched in it
+            qint64 filesystemBlockSize() const
+            {
+#ifdef Q_OS_LINUX
+                struct stat fileStat;
+                if (::fstat(m_device->handle(), &fileStat) == 0 && fileStat.st_blksize > 0)
+                    return static_cast<qint64>(fileStat.st_blksize);
+                return 4096;
+#else
+                return 0;
+#endif
+            }
+            // Moves the block at blockPos to the start of the hole before it, the free space is left after the block.
+            bool slideInMap(qint64 blockPos, int blockSize)
+            {
+                const auto blockIter = m_memoryMap->find(blockPos);
+                Q_ASSERT(blockIter != m_memoryMap->end() && blockIter != m_memoryMap->begin() && !blockIter.value());
+                auto holeIter = blockIter - 1;
+                Q_ASSERT(holeIter.value());
+                const qint64 holePos = holeIter.key();
+                const qint64 blockEnd = (blockIter + 1).key();
+                const QByteArray block = readAt(blockPos, blockSize);
+                if (block.size() != blockSize || !writeAt(holePos, block))
+                    return false;
+                eraseFreeBlock(holePos, blockPos - holePos);
+                holeIter.value() = false;
+                m_memoryMap->erase(blockIter);
+                markFree(blockPos, blockEnd - blockPos);
+                markUsed(holePos, blockSize);
+                markUsed(holePos + blockSize, blockEnd - holePos - blockSize);
+                m_memoryMap->insert(holePos + blockSize, false);
+                freeInMap(holePos + blockSize);
+                return true;
+            }
+            // Writes consecutive blocks, of blockSizes bytes each, at the end of the file in a single write and returns the position of the first.
+            // Runs of small blocks are stored as pages
+            qint64 appendInMap(const QByteArray& blocks, const QVector<int>& blockSizes)
+            {
+                if (!m_device->isWritable())
+                    return -1;
+                Q_ASSERT(m_memoryMap->last());
+                const qint64 startPos = m_memoryMap->lastKey();
+                if (!growFile(startPos + blocks.size(), startPos + blocks.size()))
+                    return -1;
+                if (!writeAt(startPos, blocks)) {
+                    shrinkFile(startPos);
+                    return -1;
+                }
+                qint64 blockPos = startPos;
+                qint64 pagePos = -1;
+                for (auto i = blockSizes.cbegin(); i != blockSizes.cend(); ++i) {
+                    if (!isPacked(*i)) {
+                        pagePos = -1;
+                        m_memoryMap->insert(blockPos, false);
+                    }
+                    else {
+                        // Consecutive small blocks share pages
+                        if (pagePos < 0 || blockPos + *i - pagePos > m_pageSize) {
+                            pagePos = blockPos;
+                            m_memoryMap->insert(pagePos, false);
+                            m_pages.insert(pagePos, 0);
+                            m_pageSpace.insert(std::make_pair(Q_INT64_C(0), pagePos));
+                        }
+                        m_packedBlocks.insert(blockPos, *i);
+                    }
+                    markUsed(blockPos, *i);
+                    blockPos += *i;
+                }
+                m_memoryMap->insert(blockPos, true);
+                return startPos;
+            }
+            void unmapFile()
+            {
+                if (!m_mappedFile)
+                    return;
+                m_device->unmap(m_mappedFile);
+                m_mappedFile = nullptr;
+                m_mappedSize = 0;
+            }
+            bool resizeFile(qint64 size)
+            {
+#ifdef Q_OS_WIN
+                // Mapped files can't be truncated on Windows
+                if (size < m_mappedSize)
+                    unmapFile();
+#endif
+                if (!m_device->resize(size))
+                    return false;
+                m_fileCapacity = size;
+                return true;
+            }
+            // Makes room for a block ending at end at the end of the file. With a growth chunk the file is extended by whole chunks
+            // allocated in advance, otherwise the write extends it up to writeEnd and only the rest is allocated.
+            bool growFile(qint64 end, qint64 writeEnd)
+            {
+                if (end <= m_fileCapacity)
+                    return true;
+                if (m_growthChunk <= 0 && end == writeEnd) {
+                    m_fileCapacity = end;
+                    return true;
+                }
+                if (m_growthChunk > 0)
+                    end = ((end + m_growthChunk - 1) / m_growthChunk) * m_growthChunk;
+#ifdef Q_OS_LINUX
+                // Reserves the space on the disk as well so later writes don't have to allocate it
+                if (::posix_fallocate(m_device->handle(), static_cast<off_t>(m_fileCapacity), static_cast<off_t>(end - m_fileCapacity)) == 0) {
+                    m_fileCapacity = end;
+                    return true;
+                }
+#endif
+                return resizeFile(end);
+            }
+            // The data now ends at end. Without a growth chunk the file is truncated there,
+            // otherwise one spare chunk is kept so data that grows and shrinks around a chunk boundary doesn't resize the file each time.
+            void shrinkFile(qint64 end)
+            {
+                if (m_growthChunk > 0)
+                    end = ((end + m_growthChunk - 1) / m_growthChunk + 1) * m_growthChunk;
+                if (end < m_fileCapacity)
+                    resizeFile(end);
+            }
+            // Reads size bytes starting at pos without using the position of m_device
+            QByteArray readAt(qint64 pos, qint64 size)
+            {
+#ifdef Q_OS_UNIX
+                return readAt(m_device->handle(), pos, size);
+#else
+                // No positional I/O, the caller holding m_fileMutex makes seek and read atomic
+                m_device->seek(pos);
+                return m_device->read(size);
+#endif
+            }
+#ifdef Q_OS_UNIX
+            // Does not touch any member so it can run without holding the container
+            static QByteArray readAt(int fileHandle, qint64 pos, qint64 size)
+            {
+                QByteArray result(static_cast<int>(size), Qt::Uninitialized);
+                qint64 totalRead = 0;
+                while (totalRead < size) {
+                    const ssize_t readRes = ::pread(fileHandle, result.data() + totalRead, static_cast<size_t>(size - totalRead), static_cast<off_t>(pos + totalRead));
+                    if (readRes < 0 && errno == EINTR)
+                        continue;
+                    if (readRes <= 0)
+                        break;
+                    totalRead += readRes;
+                }
+                result.resize(static_cast<int>(totalRead));
+                return result;
+            }
+#endif
+            // Writes block starting at pos without using the position of m_device
+            bool writeAt(qint64 pos, const QByteArray& block)
+            {
+#ifdef Q_OS_UNIX
+                const int fileHandle = m_device->handle();
+                qint64 totalWritten = 0;
+                while (totalWritten < block.size()) {
+                    const ssize_t writeRes = ::pwrite(fileHandle, block.constData() + totalWritten, static_cast<size_t>(block.size() - totalWritten), static_cast<off_t>(pos + totalWritten));
+                    if (writeRes < 0 && errno == EINTR)
+                        continue;
+                    if (writeRes <= 0)
+                        return false;
+                    totalWritten += writeRes;
+                }
+                return true;
+#else
+                m_device->seek(pos);
+                m_unflushedWrites = true;
+                return m_device->write(block) == block.size();
+#endif
+            }
+            // Reads size bytes starting at pos. In memory mapped mode the result is a view over the mapping
+            // that stays valid until the file is remapped
+            QByteArray readRange(qint64 pos, qint64 size)
+            {
+                if (m_memoryMapped) {
+                    if (m_unflushedWrites) {
+                        m_device->flush();
+                        m_unflushedWrites = false;
+                    }
+                    if (pos + size > m_mappedSize) {
+                        // The file grew, map it again
+                        unmapFile();
+                        const qint64 fileSize = m_device->size();
+                        if (pos + size <= fileSize) {
+                            m_mappedFile = m_device->map(0, fileSize);
+                            if (m_mappedFile)
+                                m_mappedSize = fileSize;
+                        }
+                    }
+                    if (pos + size <= m_mappedSize)
+                        return QByteArray::fromRawData(reinterpret_cast<const char*>(m_mappedFile + pos), static_cast<int>(size));
+                }
+                return readAt(pos, size);
+            }
+            // Applies the result of a background write to obj
+            void finishWrite(ContainerObjectData<ValueType>* obj, const QPair<qint64, int>& block)
+            {
+                Q_ASSERT(obj->m_isWriting);
+                obj->m_isWriting = false;
+                if (block.first >= 0) {
+                    obj->setFPos(block.first, block.second);
+                    recordWrite(obj, true);
+                }
+                else
+                    m_cache->restore(obj);
+            }
+            // Starts keeping the owner of every block so compaction doesn't have to scan the index to find them.
+            void trackOwners()
+            {
+                if (m_ownersTracked)
+                    return;
+                m_ownersTracked = true;
+                for (auto i = m_itemsMap->constBegin(); i != m_itemsMap->constEnd(); ++i) {
+                    if (i->fPos() >= 0)
+                        m_blockOwners.insert(i->fPos(), i.key());
+                }
+            }
+            // The background writer must be idle
+            void untrackOwners()
+            {
+                m_ownersTracked = false;
+                m_blockOwners.clear();
+            }
+            void setBlockOwner(qint64 pos, const KeyType& key)
+            {
+                if (!m_ownersTracked || pos < 0)
+                    return;
+                m_blockOwners.remove(pos);
+                m_blockOwners.insert(pos, key);
+            }
+            // Caches the value of key held by obj
+            void cacheValue(ContainerObjectData<ValueType>* obj, const KeyType& key)
+            {
+                m_cache->insert(obj);
+                m_cachedKeys.remove(obj);
+                m_cachedKeys.insert(obj, key);
+                releaseGhosts();
+            }
+            // Turns the item of obj back into a flat entry if nothing else refers to obj. obj may be deleted
+            void releaseValue(const ContainerObjectData<ValueType>* obj)
+            {
+                const auto keyIter = m_cachedKeys.find(obj);
+                if (keyIter == m_cachedKeys.end() || obj->isTracked() || obj->isAvailable())
+                    return;
+                const auto itemIter = m_itemsMap->find(keyIter.value());
+                m_cachedKeys.erase(keyIter);
+                if (itemIter != m_itemsMap->end() && itemIter->data() == obj)
+                    itemIter->flatten();
+            }
+            // Releases the ghosts the cache forgot
+            void releaseGhosts()
+            {
+                const auto dropped = m_cache->takeDroppedGhosts();
+                for (auto i = dropped.cbegin(); i != dropped.cend(); ++i)
+                    releaseValue(*i);
+            }
+            // Records the owner of the block obj was written to. If obj left the cache its item is released, see releaseValue()
+            void recordWrite(const ContainerObjectData<ValueType>* obj, bool leftCache)
+            {
+                const auto keyIter = m_cachedKeys.constFind(obj);
+                if (keyIter == m_cachedKeys.constEnd())
+                    return;
+                if (m_ownersTracked && obj->m_fPos >= 0) {
+                    QMutexLocker fileLocker(&m_fileMutex);
+                    setBlockOwner(obj->m_fPos, keyIter.value());
+                }
+                if (leftCache)
+                    releaseValue(obj);
             }
-            ~HugeContainerData() = default;
-            HugeContainerData(HugeContainerData& other)
-                : QSharedData(other)
-                , m_device(std::make_unique<QTemporaryFile>(QDir::tempPath() + QDir::separator() + QStringLiteral("HugeContainerDataXXXXXX")))
-                , m_cache(std::make_unique<QQueue<KeyType> >(*(other.m_cache)))
-                , m_memoryMap(std::make_unique<QMap<qint64, bool> >(*(other.m_memoryMap)))
-                , m_itemsMap(std::make_unique<ItemMapType>(*(other.m_itemsMap)))
-                , m_maxCache(other.m_maxCache)
-                , m_compressionLevel(other.m_compressionLevel)
+            // Applies the results of the background writes completed so far
+            void collectWrites()
             {
-                if (!m_device->open())
-                    Q_ASSERT_X(false, "HugeContainer::HugeContainer", "Unable to create a temporary file");
-                other.m_device->seek(0);
-                qint64 totalSize = other.m_device->size();
-                for (; totalSize > 1024; totalSize -= 1024)
-                    m_device->write(other.m_device->read(1024));
-                m_device->write(other.m_device->read(totalSize));
+                const auto finished = m_writeQueue->takeFinished();
+                for (auto i = finished.cbegin(); i != finished.cend(); ++i)
+                    finishWrite(i.key(), i.value());
+            }
+            // Waits for the background writer to complete and applies the results
+            void settleWrites()
+            {
+                m_writeQueue->flush();
+                collectWrites();
             }
-
         };
 
         using NormalContaineType = typename std::conditional<sorted, QMap<KeyType, ValueType>, QHash<KeyType, ValueType> >::type;
         using NormalStdContaineType = typename std::conditional<sorted, std::map<KeyType, ValueType>, std::unordered_map<KeyType, ValueType> >::type;
         QExplicitlySharedDataPointer<HugeContainerData<KeyType, ValueType, sorted> > m_d;
-        std::unique_ptr<ValueType> valueFromBlock(const KeyType& key) const
+        // Device that discards the data, used to measure the serialized size of values
+        class ByteCounter : public QIODevice
+        {
+            qint64 m_bytes;
+        protected:
+            qint64 readData(char*, qint64) Q_DECL_OVERRIDE { return -1; }
+            qint64 writeData(const char*, qint64 len) Q_DECL_OVERRIDE { m_bytes += len; return len; }
+        public:
+            ByteCounter()
+                : QIODevice()
+                , m_bytes(0)
+            {
+                open(QIODevice::WriteOnly);
+            }
+            qint64 bytes() const { return m_bytes; }
+        };
+        std::unique_ptr<ValueType> valueFromData(const QByteArray& block) const
         {
-            QByteArray block = readBlock(key);
-            if (block.isEmpty())
-                return nullptr;
             auto result = std::make_unique<ValueType>();
-            QDataStream readerStream(block);
-            readerStream >> *result;
+            if (!HugeContainerData<KeyType, ValueType, sorted>::decodeValue(block, *result))
+                return nullptr;
             return result;
         }
+        std::unique_ptr<ValueType> valueFromBlock(const KeyType& key) const
+        {
+            return valueFromData(readBlock(key));
+        }
+        // Reads a value from the file and moves it to the cache
+        bool loadValue(const KeyType& key) const
+        {
+            const auto itemIter = m_d->m_itemsMap->constFind(key);
+            Q_ASSERT(itemIter != m_d->m_itemsMap->constEnd());
+            const auto aheadIter = m_d->m_readAheadValues.find(itemIter->fPos());
+            if (aheadIter != m_d->m_readAheadValues.end()) {
+                auto result = std::make_unique<ValueType>(std::move(aheadIter.value()));
+                m_d->m_readAheadValues.erase(aheadIter);
+                return enqueueValue(key, result, -1, 0.0, true);
+            }
+            QElapsedTimer decodeTimer;
+            decodeTimer.start();
+            const QByteArray block = readBlock(key);
+            auto result = valueFromData(block);
+            if (!result)
+                return false;
+            const double cacheWeight = static_cast<double>(qMax(Q_INT64_C(1), decodeTimer.nsecsElapsed())) / static_cast<double>(block.size());
+            return enqueueValue(key, result, block.size(), cacheWeight, true);
+        }
+        qint64 valueSize(const ValueType& val) const
+        {
+            if (m_d->m_valueSizeFunction)
+                return m_d->m_valueSizeFunction(val);
+            if (HugeContainerData<KeyType, ValueType, sorted>::RawValue::value)
+                return sizeof(ValueType);
+            ByteCounter counter;
+            QDataStream counterStream(&counter);
+            counterStream << val;
+            return counter.bytes();
+        }
+        // Size accounted to val in the cache
+        qint64 cachedSize(const ValueType& val) const
+        {
+            if (m_d->m_maxCacheBytes <= 0)
+                return 0;
+            return valueSize(val);
+        }
+        // Values modified through references might have changed size since they were measured
+        void measureChangedValues() const
+        {
+            m_d->m_cache->updateChangedSizes([this](const ValueType& cachedVal) -> qint64 { return valueSize(cachedVal); });
+        }
+        bool isCacheFull(qint64 incomingSize) const
+        {
+            if (m_d->m_cache->isEmpty())
+                return false;
+            if (m_d->m_maxCacheBytes > 0) {
+                measureChangedValues();
+                return m_d->m_cache->bytes() + incomingSize > m_d->m_maxCacheBytes;
+            }
+            return m_d->m_cache->size() >= m_d->m_maxCache;
+        }
+        bool shrinkCache() const
+        {
+            if (m_d->m_maxCacheBytes > 0) {
+                measureChangedValues();
+                while (m_d->m_cache->bytes() > m_d->m_maxCacheBytes) {
+                    if (!saveQueue())
+                        return false;
+                }
+                return true;
+            }
+            if (m_d->m_cache->size() > m_d->m_maxCache)
+                return saveQueue(m_d->m_cache->size() - m_d->m_maxCache);
+            return true;
+        }
+        // Evicts values until count more values of the given total size fit in the cache
+        bool makeRoom(int count, qint64 bytes) const
+        {
+            if (m_d->m_maxCacheBytes > 0) {
+                measureChangedValues();
+                while (!m_d->m_cache->isEmpty() && m_d->m_cache->bytes() + bytes > m_d->m_maxCacheBytes) {
+                    if (!saveQueue())
+                        return false;
+                }
+                return true;
+            }
+            const int excess = qMin(m_d->m_cache->size(), m_d->m_cache->size() + count - m_d->m_maxCache);
+            return excess <= 0 || saveQueue(excess);
+        }
         bool defrag(bool readCompressed, int writeCompression)
         {
             if (isEmpty()) 
                 return true;
+            m_d->settleWrites();
             Q_ASSERT(m_d->m_memoryMap->size() > 1);
             auto newFile = std::make_unique<QTemporaryFile>(QDir::tempPath() + QDir::separator() + QStringLiteral("HugeContainerDataXXXXXX"));
             if (!newFile->open())
                 return false;
             auto newMap = std::make_unique<QMap<qint64, bool> >();
-            std::conditional<sorted, QMap<KeyType, qint64>, QHash<KeyType, qint64> >::type oldPos;
+            std::conditional<sorted, QMap<KeyType, QPair<qint64, int> >, QHash<KeyType, QPair<qint64, int> > >::type oldPos;
+            // Small blocks are gathered in a page that is written when the next one doesn't fit
+            QMap<qint64, qint64> newPackedBlocks;
+            QMap<qint64, qint64> newPages;
+            QByteArray page;
+            QVector<QPair<KeyType, int> > pageBlocks;
+            const auto writePage = [&]() -> bool {
+                if (pageBlocks.isEmpty())
+                    return true;
+                const qint64 pagePos = newFile->pos();
+                if (newFile->write(page) < 0)
+                    return false;
+                newMap->insert(pagePos, false);
+                newPages.insert(pagePos, 0);
+                qint64 blockPos = pagePos;
+                for (auto j = pageBlocks.cbegin(); j != pageBlocks.cend(); ++j) {
+                    m_d->m_itemsMap->find(j->first)->relocate(blockPos, j->second);
+                    newPackedBlocks.insert(blockPos, j->second);
+                    blockPos += j->second;
+                }
+                page.clear();
+                pageBlocks.clear();
+                return true;
+            };
             bool allGood = true;
             for (auto i = m_d->m_itemsMap->begin(); allGood && i != m_d->m_itemsMap->end(); ++i) {
-                if (i->isAvailable())
+                if (i->fPos() < 0)
                     continue;
-                const auto newMapIter = newMap->insert(newFile->pos(), false);
+                if (!i->hasFileCopy()) {
+                    // The block of a dirty value is dropped, the value gets a new one when it's written
+                    oldPos.insert(i.key(), qMakePair(i->fPos(), i->fSize()));
+                    i->relocate(-1, -1);
+                    continue;
+                }
+                // Clean values keep their copy in the file
                 QByteArray blockToWrite = readBlock(i.key(), readCompressed);
                 if (writeCompression != 0)
                     blockToWrite = qCompress(blockToWrite, writeCompression);
+                if (m_d->isPacked(blockToWrite.size())) {
+                    if (page.size() + blockToWrite.size() > m_d->m_pageSize)
+                        allGood = writePage();
+                    oldPos.insert(i.key(), qMakePair(i->fPos(), i->fSize()));
+                    pageBlocks.append(qMakePair(i.key(), blockToWrite.size()));
+                    page.append(blockToWrite);
+                    continue;
+                }
+                const auto newMapIter = newMap->insert(newFile->pos(), false);
                 if (newFile->write(blockToWrite) >= 0) {
-                    oldPos.insert(i.key(), i->fPos());
-                    i->setFPos (newMapIter.key());
+                    oldPos.insert(i.key(), qMakePair(i->fPos(), i->fSize()));
+                    i->relocate(newMapIter.key(), blockToWrite.size());
                 }
                 else {
                     allGood = false;
                 }
             }
+            if (allGood)
+                allGood = writePage();
+            // Blocks are read back with positional I/O that bypasses the buffer of the device
+            if (allGood)
+                allGood = newFile->flush();
             if (!allGood) {
-                for (auto i = oldPos.constEnd(); i != oldPos.constEnd(); ++i) {
+                for (auto i = oldPos.constBegin(); i != oldPos.constEnd(); ++i) {
                     auto oldMapIter = m_d->m_itemsMap->find(i.key());
                     Q_ASSERT(oldMapIter != m_d->m_itemsMap->end());
-                    oldMapIter.value().setFPos(i.value());
+                    oldMapIter.value().relocate(i.value().first, i.value().second);
                 }
                 return false;
             }
             newMap->insert(newFile->pos(), true);
+            m_d->unmapFile();
+            ++m_d->m_fileGeneration;
             m_d->m_device = std::move(newFile);
             m_d->m_memoryMap = std::move(newMap);
+            m_d->m_fileCapacity = m_d->m_memoryMap->lastKey();
+            m_d->m_freeBlocks.clear();
+            m_d->m_freeBytes = 0;
+            m_d->rebuildSegments();
+            m_d->clearPages();
+            m_d->m_packedBlocks = newPackedBlocks;
+            m_d->m_pages = newPages;
+            for (auto i = newPages.constBegin(); i != newPages.constEnd(); ++i)
+                m_d->m_pageSpace.insert(std::make_pair(i.value(), i.key()));
+            m_d->m_readAheadValues.clear();
+            // Every block moved, the owners are looked up again the next time they are needed
+            m_d->untrackOwners();
             return true;
         }
+        // Writes block in a new block of the file leaving the headroom after it
         qint64 writeInMap(const QByteArray& block) const
         {
-            if (!m_d->m_device->isWritable())
-                return -1;
-            for (auto i = m_d->m_memoryMap->begin(); i != m_d->m_memoryMap->end(); ++i) {
-                if (i.value()) {
-                    // Space is available
-                    auto j = i + 1;
-                    if (j != m_d->m_memoryMap->end()) {
-                        if (i.key() + static_cast<qint64>(block.size()) > j.key())
-                            // Not enough space to save here 
-                            continue;
-                        if (i.key() + static_cast<qint64>(block.size()) < j.key()) {
-                            // Item smaller than available space
-                            m_d->m_memoryMap->insert(i.key() + static_cast<qint64>(block.size()), true);
-                        }
-                    }
-                    else {
-                        m_d->m_memoryMap->insert(i.key() + block.size(), true);
-                    }
-                    i.value() = false;
-                    m_d->m_device->seek(i.key());
-                    if(m_d->m_device->write(block)>=0)
-                        return i.key();
-                    return -1;
-                }
-            }
-            Q_UNREACHABLE();
-            return 0;
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            return m_d->writeInMap(block, block.size() + static_cast<qint64>(block.size() * m_d->m_slotHeadroom));
+        }
+        // Writes block in place of the stale block at slot if it fits, otherwise in a new block
+        qint64 rewriteInMap(qint64 slot, const QByteArray& block) const
+        {
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            return m_d->rewriteInMap(slot, block, m_d->m_slotHeadroom);
+        }
+        // Records key as the owner of the block at pos, see HugeContainerData::trackOwners()
+        void setBlockOwner(qint64 pos, const KeyType& key) const
+        {
+            if (!m_d->m_ownersTracked)
+                return;
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            m_d->setBlockOwner(pos, key);
         }
         void removeFromMap(qint64 pos) const {
-            auto fileIter = m_d->m_memoryMap->find(pos);
-            Q_ASSERT(fileIter != m_d->m_memoryMap->end());
-            if (fileIter.value())
+            m_d->m_readAheadValues.remove(pos);
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            ++m_d->m_fileGeneration;
+            m_d->freeInMap(pos);
+        }
+        // The value is about to be replaced, the copy in the file becomes stale but its block is kept to write the new value in place
+        void releaseFileCopy(ContainerObject<ValueType>& item) const
+        {
+            if (!item.hasFileCopy())
                 return;
-            if (fileIter != m_d->m_memoryMap->begin()) {
-                if ((fileIter - 1).value()) {
-                    fileIter = m_d->m_memoryMap->erase(fileIter);
-                    Q_ASSERT(fileIter != m_d->m_memoryMap->end());
-                    if (fileIter.value())
-                        fileIter = m_d->m_memoryMap->erase(fileIter);
-                    if (fileIter == m_d->m_memoryMap->end())
-                        m_d->m_device->resize(m_d->m_memoryMap->lastKey());
-                    return;
+            m_d->m_readAheadValues.remove(item.fPos());
+            {
+                QMutexLocker fileLocker(&m_d->m_fileMutex);
+                ++m_d->m_fileGeneration;
+            }
+            item.markDirty();
+        }
+        // Position of the first hole in the file
+        qint64 firstHole() const
+        {
+            Q_ASSERT(!m_d->m_freeBlocks.empty());
+            return std::min_element(m_d->m_freeBlocks.cbegin(), m_d->m_freeBlocks.cend(), [](const std::pair<qint64, qint64>& a, const std::pair<qint64, qint64>& b) ->bool {return a.second < b.second; })->second;
+        }
+        // Item owning the block at pos, the end of the items if it has none or its value is being written in the background.
+        typename HugeContainerData<KeyType, ValueType, sorted>::ItemMapType::iterator blockOwner(qint64 pos) const
+        {
+            Q_ASSERT(m_d->m_ownersTracked);
+            const auto ownerIter = m_d->m_blockOwners.constFind(pos);
+            if (ownerIter == m_d->m_blockOwners.constEnd())
+                return m_d->m_itemsMap->end();
+            const auto itemIter = m_d->m_itemsMap->find(ownerIter.value());
+            if (itemIter == m_d->m_itemsMap->end() || itemIter->fPos() != pos || itemIter->isWriting())
+                return m_d->m_itemsMap->end();
+            return itemIter;
+        }
+        // True if the owner of every block of the page at pagePos is known and none of them is being written in the background,
+        // the writer might rewrite it in place
+        bool canMovePage(qint64 pagePos) const
+        {
+            const qint64 pageEnd = pagePos + m_d->extentSize(pagePos);
+            const QMap<qint64, qint64>& packedBlocks = m_d->m_packedBlocks;
+            for (auto i = packedBlocks.lowerBound(pagePos); i != packedBlocks.constEnd() && i.key() < pageEnd; ++i) {
+                const auto ownerIter = m_d->m_blockOwners.constFind(i.key());
+                if (ownerIter == m_d->m_blockOwners.constEnd())
+                    return false;
+                const auto itemIter = m_d->m_itemsMap->constFind(ownerIter.value());
+                if (itemIter == m_d->m_itemsMap->constEnd() || itemIter->fPos() != i.key() || itemIter->isWriting())
+                    return false;
+            }
+            return true;
+        }
+        // Body of compact(). Blocks of values being written in the background are not moved
+        qint64 compactFile(qint64 maxBytes)
+        {
+            if (m_d->m_freeBlocks.empty() || !m_d->m_device->isWritable())
+                return 0;
+            qint64 holePos = firstHole();
+            m_d->trackOwners();
+            qint64 result = 0;
+            while (!m_d->m_freeBlocks.empty()) {
+                qint64 blockPos = (m_d->m_memoryMap->constEnd() - 2).key();
+                bool isPage = m_d->m_pages.contains(blockPos);
+                auto itemIter = isPage ? m_d->m_itemsMap->end() : blockOwner(blockPos);
+                if (isPage ? !canMovePage(blockPos) : itemIter == m_d->m_itemsMap->end())
+                    break;
+                bool slide = false;
+                if ((isPage || itemIter->hasFileCopy()) && m_d->m_freeBlocks.lower_bound(std::make_pair(isPage ? m_d->extentSize(blockPos) : static_cast<qint64>(itemIter->fSize()), Q_INT64_C(0))) == m_d->m_freeBlocks.end()) {
+                    const auto holeIter = m_d->m_memoryMap->constFind(holePos);
+                    if (holeIter == m_d->m_memoryMap->constEnd() || !holeIter.value())
+                        holePos = firstHole();
+                    blockPos = (m_d->m_memoryMap->constFind(holePos) + 1).key();
+                    isPage = m_d->m_pages.contains(blockPos);
+                    itemIter = isPage ? m_d->m_itemsMap->end() : blockOwner(blockPos);
+                    if (isPage ? !canMovePage(blockPos) : itemIter == m_d->m_itemsMap->end())
+                        break;
+                    slide = true;
+                }
+                ++m_d->m_fileGeneration;
+                if (isPage) {
+                    const qint64 pageSize = m_d->extentSize(blockPos);
+                    if (result > 0 && result + pageSize > maxBytes)
+                        break;
+                    if (!movePage(blockPos, slide))
+                        return -1;
+                    if (slide)
+                        holePos += pageSize;
+                    result += pageSize;
+                    continue;
+                }
+                m_d->m_readAheadValues.remove(blockPos);
+                if (!itemIter->hasFileCopy()) {
+                    // The value gets a new block when it's written
+                    itemIter->relocate(-1, -1);
+                    m_d->freeInMap(blockPos);
+                    continue;
+                }
+                const int blockSize = itemIter->fSize();
+                if (result > 0 && result + blockSize > maxBytes)
+                    break;
+                qint64 newPos;
+                if (slide) {
+                    if (!m_d->slideInMap(blockPos, blockSize))
+                        return -1;
+                    m_d->m_blockOwners.remove(blockPos);
+                    newPos = holePos;
+                    holePos += blockSize;
                 }
+                else {
+                    const QByteArray block = m_d->readAt(blockPos, blockSize);
+                    if (block.size() != blockSize)
+                        return -1;
+                    // All the holes are before the last block
+                    newPos = m_d->writeInExtent(m_d->bestFit(blockSize), block);
+                    if (newPos < 0)
+                        return -1;
+                    m_d->freeInMap(blockPos);
+                }
+                itemIter->relocate(newPos, blockSize);
+                m_d->setBlockOwner(newPos, itemIter.key());
+                result += blockSize;
             }
-            fileIter.value() = true;
-            if (++fileIter != m_d->m_memoryMap->end()) {
-                if (fileIter.value())
-                    fileIter = m_d->m_memoryMap->erase(fileIter);
+            return result;
+        }
+        // Moves the page at pagePos to the hole before it if slide is true, otherwise to the smallest hole it fits in,
+        // and relocates the values stored in it. See canMovePage()
+        bool movePage(qint64 pagePos, bool slide)
+        {
+            const qint64 pageSize = m_d->extentSize(pagePos);
+            // Moving the page frees the positions of its blocks
+            QVector<QPair<qint64, KeyType> > owners;
+            const QMultiMap<qint64, KeyType>& blockOwners = m_d->m_blockOwners;
+            for (auto i = blockOwners.lowerBound(pagePos); i != blockOwners.constEnd() && i.key() < pagePos + pageSize; ++i)
+                owners.append(qMakePair(i.key(), i.value()));
+            qint64 newPos;
+            if (slide) {
+                newPos = (m_d->m_memoryMap->constFind(pagePos) - 1).key();
+                // The blocks of the page must not be mistaken for the free space left behind
+                m_d->relocatePage(pagePos, newPos, pageSize);
+                if (!m_d->slideInMap(pagePos, pageSize)) {
+                    m_d->relocatePage(newPos, pagePos, pageSize);
+                    return false;
+                }
+            }
+            else {
+                const QByteArray page = m_d->readAt(pagePos, pageSize);
+                if (page.size() != pageSize)
+                    return false;
+                newPos = m_d->writeInExtent(m_d->bestFit(pageSize), page);
+                if (newPos < 0)
+                    return false;
+                m_d->relocatePage(pagePos, newPos, pageSize);
+                m_d->freeInMap(pagePos);
             }
-            if (fileIter == m_d->m_memoryMap->end())
-                m_d->m_device->resize(m_d->m_memoryMap->lastKey());
+            // The old and new positions of the blocks can overlap
+            for (auto i = owners.cbegin(); i != owners.cend(); ++i)
+                m_d->m_blockOwners.remove(i->first);
+            for (auto i = owners.cbegin(); i != owners.cend(); ++i) {
+                const auto itemIter = m_d->m_itemsMap->find(i->second);
+                if (itemIter == m_d->m_itemsMap->end() || itemIter->fPos() != i->first)
+                    continue;
+                const qint64 blockPos = i->first - pagePos + newPos;
+                m_d->m_readAheadValues.remove(i->first);
+                itemIter->relocate(blockPos, itemIter->fSize());
+                m_d->setBlockOwner(blockPos, i->second);
+            }
+            return true;
         }
-        qint64 writeElementInMap(const ValueType& val) const
+        // Maintenance of the file after the operations that change it, a failure doesn't undo the change. See maintenanceFailed()
+        void maintainFile()
         {
-            QByteArray block;
-            {
-                QDataStream writerStream(&block, QIODevice::WriteOnly);
-                writerStream << val;
+            const bool collected = autoCollect();
+            m_d->m_maintenanceFailed = !autoCompact() || !collected;
+        }
+        // Segment the log is appended to and the one the file ends in, they are not collected
+        bool isActiveSegment(qint64 segment) const
+        {
+            if (m_d->m_logHead >= 0 && m_d->m_logHead / m_d->m_segmentSize == segment)
+                return true;
+            const qint64 usedSize = m_d->m_memoryMap->lastKey();
+            return usedSize > 0 && (usedSize - 1) / m_d->m_segmentSize == segment;
+        }
+        // Rewrites the live blocks of segment at the head of the log, except those the background writer will free.
+        // Returns the number of bytes moved, -1 if a block could not be moved
+        qint64 collectSegment(qint64 segment)
+        {
+            const qint64 segmentStart = segment * m_d->m_segmentSize;
+            const qint64 segmentEnd = segmentStart + m_d->m_segmentSize;
+            m_d->trackOwners();
+            // Blocks packed before the log was enabled belong to the segment their page starts in
+            qint64 rangeEnd = segmentEnd;
+            const QMap<qint64, qint64>& pages = m_d->m_pages;
+            const auto pageIter = pages.lowerBound(segmentEnd);
+            if (pageIter != pages.constBegin() && (pageIter - 1).key() >= segmentStart)
+                rangeEnd = qMax(rangeEnd, (pageIter - 1).key() + m_d->extentSize((pageIter - 1).key()));
+            QVector<QPair<qint64, KeyType> > owners;
+            const QMultiMap<qint64, KeyType>& blockOwners = m_d->m_blockOwners;
+            for (auto i = blockOwners.lowerBound(segmentStart); i != blockOwners.constEnd() && i.key() < rangeEnd; ++i) {
+                const qint64 extentPos = m_d->extentOf(i.key());
+                if (extentPos >= segmentStart && extentPos < segmentEnd)
+                    owners.append(qMakePair(i.key(), i.value()));
+            }
+            if (m_d->m_logHead >= segmentStart && m_d->m_logHead < segmentEnd)
+                m_d->m_logHead = -1;
+            m_d->m_collectedSegment = segment;
+            qint64 result = 0;
+            for (auto i = owners.cbegin(); i != owners.cend(); ++i) {
+                auto itemIter = m_d->m_itemsMap->find(i->second);
+                const qint64 blockPos = i->first;
+                if (itemIter == m_d->m_itemsMap->end() || itemIter->fPos() != blockPos || itemIter->isWriting())
+                    continue;
+                ++m_d->m_fileGeneration;
+                m_d->m_readAheadValues.remove(blockPos);
+                if (!itemIter->hasFileCopy()) {
+                    // The value gets a new block when it's written
+                    itemIter->relocate(-1, -1);
+                    m_d->freeInMap(blockPos);
+                    continue;
+                }
+                const int blockSize = itemIter->fSize();
+                const QByteArray block = m_d->readAt(blockPos, blockSize);
+                const qint64 newPos = block.size() == blockSize ? m_d->writeInMap(block) : -1;
+                if (newPos < 0) {
+                    result = -1;
+                    break;
+                }
+                itemIter->relocate(newPos, blockSize);
+                m_d->freeInMap(blockPos);
+                m_d->setBlockOwner(newPos, i->second);
+                result += blockSize;
             }
-            if (m_d->m_compressionLevel!=0)
-                block = qCompress(block, m_d->m_compressionLevel);
-            const qint64 result = writeInMap(block);
+            m_d->m_collectedSegment = -1;
+            if (result >= 0)
+                m_d->m_gcCandidates.remove(segment);
             return result;
         }
-        bool saveQueue(int numElements = 1) const{
+        // Collects a segment whose live data fell below the threshold of setLogStructured(). False if a block could not be moved
+        bool autoCollect()
+        {
+            if (m_d->m_segmentSize <= 0)
+                return true;
+            // Only finished writes are collected, collectSegment() skips the blocks still being written
+            m_d->collectWrites();
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            for (auto i = m_d->m_gcCandidates.begin(); i != m_d->m_gcCandidates.end(); ++i) {
+                if (!isActiveSegment(*i))
+                    return collectSegment(*i) >= 0;
+            }
+            return true;
+        }
+        // Runs a step of compact() as set by setAutoCompaction(). False if a block could not be moved
+        bool autoCompact()
+        {
+            if (m_d->m_compactionHigh <= 0.0)
+                return true;
+            // Blocks still being written are left where they are
+            m_d->collectWrites();
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            qint64 usedSize = m_d->m_memoryMap->lastKey();
+            const bool aboveHigh = usedSize >= m_d->m_compactionMinSize && usedSize > 0 && static_cast<double>(m_d->m_freeBytes) >= m_d->m_compactionHigh * static_cast<double>(usedSize);
+            if (!m_d->m_compacting) {
+                if (!aboveHigh)
+                    return true;
+                m_d->m_compacting = true;
+            }
+            else if (!aboveHigh && qAbs(m_d->m_freeBytes - m_d->m_compactionFreeMark) + qAbs(usedSize - m_d->m_compactionUsedMark) < m_d->m_compactionStep) {
+                // Between the watermarks a step only runs once the file changed by as many bytes as it moves
+                return true;
+            }
+            const qint64 moved = compactFile(m_d->m_compactionStep);
+            usedSize = m_d->m_memoryMap->lastKey();
+            m_d->m_compactionFreeMark = m_d->m_freeBytes;
+            m_d->m_compactionUsedMark = usedSize;
+            if (moved <= 0 || static_cast<double>(m_d->m_freeBytes) <= m_d->m_compactionLow * static_cast<double>(usedSize))
+                m_d->m_compacting = false;
+            return moved >= 0;
+        }
+        // Encodes val in block and returns true if it's small enough to be kept inline. block is left null if values are never kept inline
+        bool encodeInline(const ValueType& val, QByteArray& block) const
+        {
+            if (m_d->m_inlineSize <= 0)
+                return false;
+            block = HugeContainerData<KeyType, ValueType, sorted>::encodeValue(val);
+            return block.size() <= m_d->m_inlineSize;
+        }
+        // Keeps block, the serialized value of obj, in obj and frees its block in the file
+        void storeInline(ContainerObjectData<ValueType>* obj, const QByteArray& block) const
+        {
+            if (obj->m_fPos >= 0)
+                removeFromMap(obj->m_fPos);
+            obj->setInline(block);
+        }
+        bool saveQueue(int numElements = 1, const ContainerObjectData<ValueType>* incoming = nullptr) const{
             bool allOk=true;
+            m_d->collectWrites();
             for (; allOk && numElements > 0; --numElements) {
                 Q_ASSERT(!m_d->m_cache->isEmpty());
-                const KeyType keyToWrite = m_d->m_cache->dequeue();
-                auto valToWrite = m_d->m_itemsMap->find(keyToWrite);
-                Q_ASSERT(valToWrite != m_d->m_itemsMap->end());
-                Q_ASSERT(valToWrite->isAvailable());
-                const qint64 result = writeElementInMap(*(valToWrite->val()));
+                ContainerObjectData<ValueType>* const objToWrite = m_d->m_cache->takeVictim(incoming);
+                if (!objToWrite->isDirty()) {
+                    // The file already holds an up to date copy
+                    objToWrite->setFPos(objToWrite->m_fPos, objToWrite->m_fSize);
+                    m_d->recordWrite(objToWrite, true);
+                    continue;
+                }
+                QByteArray block;
+                if (encodeInline(*(objToWrite->m_val), block)) {
+                    storeInline(objToWrite, block);
+                    m_d->recordWrite(objToWrite, true);
+                    continue;
+                }
+                if (m_d->m_writeQueue->isEnabled()) {
+                    // The value stays in memory until the background writer is done with it
+                    objToWrite->m_isWriting = true;
+                    // Without a size from the cache the queue estimates it, serializing here would be the work the thread takes over
+                    const qint64 queuedBytes = objToWrite->m_cacheSize > 0 ? objToWrite->m_cacheSize : -1;
+                    m_d->m_writeQueue->enqueue(objToWrite, queuedBytes, m_d->m_compressionLevel, m_d->m_slotHeadroom);
+                    continue;
+                }
+                if (block.isNull())
+                    block = HugeContainerData<KeyType, ValueType, sorted>::serializeValue(*(objToWrite->m_val), m_d->m_compressionLevel);
+                else
+                    block = HugeContainerData<KeyType, ValueType, sorted>::compressBlock(block, m_d->m_compressionLevel);
+                const qint64 result = rewriteInMap(objToWrite->m_fPos, block);
                 if (result>=0) {
-                    valToWrite->setFPos(result);
+                    objToWrite->setFPos(result, block.size());
+                    m_d->recordWrite(objToWrite, true);
                 }
                 else{
-                    m_d->m_cache->prepend(keyToWrite);
+                    m_d->m_cache->restore(objToWrite);
                     allOk = false;
                 }
             }
             return allOk;
         }
 
-        bool enqueueValue(const KeyType& key, std::unique_ptr<ValueType>& val) const
+        // Called by iterators before reading a value. After a run of sequential steps the values of the next readAhead() items
+        // are read in a single pass and decoded ahead of the iterator, they count against the cache limit
+        template <class ItemIterator>
+        void prefetch(const ItemIterator& itemIter, int sequentialSteps) const
+        {
+            if (m_d->m_readAhead <= 0 || qAbs(sequentialSteps) < 2)
+                return;
+            typename HugeContainerData<KeyType, ValueType, sorted>::ItemMapType::const_iterator i = itemIter;
+            if (i->isAvailable() || i->isInline() || m_d->m_readAheadValues.contains(i->fPos()))
+                return;
+            // The size of the blocks stands for the size of the values when the cache is limited in bytes
+            const int maxValues = m_d->m_maxCacheBytes > 0 ? m_d->m_readAhead : qMin(m_d->m_readAhead, m_d->m_maxCache);
+            QVector<QPair<qint64, int> > positions;
+            positions.reserve(maxValues);
+            qint64 aheadBytes = 0;
+            for (int count = 0; count < m_d->m_readAhead && positions.size() < maxValues; ++count) {
+                if (!i->isAvailable() && !i->isInline()) {
+                    if (m_d->m_maxCacheBytes > 0 && aheadBytes + i->fSize() > m_d->m_maxCacheBytes)
+                        break;
+                    positions.append(qMakePair(i->fPos(), i->fSize()));
+                    aheadBytes += i->fSize();
+                }
+                if (sequentialSteps > 0) {
+                    if (++i == m_d->m_itemsMap->constEnd())
+                        break;
+                }
+                else {
+                    if (i == m_d->m_itemsMap->constBegin())
+                        break;
+                    --i;
+                }
+            }
+            // The values that were read ahead before and not used are discarded
+            m_d->m_readAheadValues.clear();
+            // Evicting writes to the file, it must happen before the blocks are read
+            if (positions.size() < 2 || !makeRoom(positions.size(), aheadBytes))
+                return;
+            std::sort(positions.begin(), positions.end());
+            QVector<QByteArray> runs;
+            const QVector<QPair<qint64, QByteArray> > blocks = readBlocks(positions, runs);
+            const bool compressed = m_d->m_compressionLevel != 0;
+            for (auto j = blocks.cbegin(); j != blocks.cend(); ++j) {
+                if (!decodeBlock(j->second, compressed, m_d->m_readAheadValues[j->first]))
+                    m_d->m_readAheadValues.remove(j->first);
+            }
+        }
+        // Reads the blocks at the given positions and sizes, sorted by position. Blocks separated by less than 4KB are read in a single pass.
+        // The blocks returned are views over the data stored in runs
+        QVector<QPair<qint64, QByteArray> > readBlocks(const QVector<QPair<qint64, int> >& positions, QVector<QByteArray>& runs) const
+        {
+            const qint64 maxGap = 4096;
+            QVector<QPair<qint64, QByteArray> > blocks;
+            blocks.reserve(positions.size());
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            if (Q_UNLIKELY(!m_d->m_device->isReadable()))
+                return blocks;
+            m_d->m_device->setTextModeEnabled(false);
+            runs.reserve(positions.size());
+            for (int first = 0; first < positions.size();) {
+                const qint64 runStart = positions.at(first).first;
+                qint64 runEnd = runStart + positions.at(first).second;
+                int last = first;
+                while (last + 1 < positions.size() && positions.at(last + 1).first - runEnd <= maxGap) {
+                    ++last;
+                    runEnd = positions.at(last).first + positions.at(last).second;
+                }
+                runs.append(m_d->readRange(runStart, runEnd - runStart));
+                const QByteArray& run = runs.last();
+                for (; first <= last; ++first) {
+                    const qint64 blockStart = positions.at(first).first;
+                    const int blockSize = positions.at(first).second;
+                    if (blockStart + blockSize - runStart <= run.size())
+                        blocks.append(qMakePair(blockStart, QByteArray::fromRawData(run.constData() + (blockStart - runStart), blockSize)));
+                }
+            }
+            return blocks;
+        }
+        static bool decodeBlock(const QByteArray& data, bool compressed, ValueType& val)
         {
-            int cacheIdx = m_d->m_cache->indexOf(key);
-            if (cacheIdx >= 0) {
-                m_d->m_cache->removeAt(cacheIdx);
+            return HugeContainerData<KeyType, ValueType, sorted>::decodeValue(compressed ? qUncompress(data) : data, val);
+        }
+        // Decodes part of the blocks read by values() on a thread pool
+        class DecodeTask : public QRunnable
+        {
+            const QVector<QPair<qint64, QByteArray> >& m_blocks;
+            const int m_begin;
+            const int m_end;
+            const bool m_compressed;
+            QVector<ValueType>& m_decoded;
+            QSemaphore& m_done;
+        public:
+            DecodeTask(const QVector<QPair<qint64, QByteArray> >& blocks, int begin, int end, bool compressed, QVector<ValueType>& decoded, QSemaphore& done)
+                : QRunnable()
+                , m_blocks(blocks)
+                , m_begin(begin)
+                , m_end(end)
+                , m_compressed(compressed)
+                , m_decoded(decoded)
+                , m_done(done)
+            {}
+            void run() Q_DECL_OVERRIDE
+            {
+                for (int i = m_begin; i < m_end; ++i)
+                    decodeBlock(m_blocks.at(i).second, m_compressed, m_decoded[i]);
+                m_done.release();
+            }
+        };
+        // Removes the value from the queue of the background writer, if it was already written the copy in the file is kept
+        void cancelWrite(ContainerObject<ValueType>& item) const
+        {
+            ContainerObjectData<ValueType>* const obj = item.data();
+            Q_ASSERT(obj->m_isWriting);
+            const QPair<qint64, int> written = m_d->m_writeQueue->take(obj);
+            if (written.first >= 0) {
+                obj->m_fPos = written.first;
+                obj->m_fSize = written.second;
+                m_d->recordWrite(obj, false);
             }
-            else if (m_d->m_cache->size() == m_d->m_maxCache) {
-                if (!saveQueue()) 
+            obj->m_isWriting = false;
+        }
+        // Drops the value of item from the cache, the background writer and the file
+        void discardValue(ContainerObject<ValueType>& item) const
+        {
+            if (item.isWriting())
+                cancelWrite(item);
+            if (item.data()) {
+                m_d->m_cache->remove(item.data());
+                m_d->m_cachedKeys.remove(item.data());
+            }
+            if (item.fPos() >= 0)
+                removeFromMap(item.fPos());
+        }
+        // Moves a value queued for writing back to the cache
+        bool reclaimValue(ContainerObject<ValueType>& item) const
+        {
+            cancelWrite(item);
+            ContainerObjectData<ValueType>* const obj = item.data();
+            while (isCacheFull(obj->m_cacheSize)) {
+                if (!saveQueue(1, obj))
                     return false;
             }
-            m_d->m_cache->enqueue(key);
+            m_d->m_cache->insert(obj);
+            m_d->releaseGhosts();
+            return true;
+        }
+        // If fromFile is true val was just read from the file and the copy there is kept
+        bool enqueueValue(const KeyType& key, std::unique_ptr<ValueType>& val, qint64 valSize = -1, double cacheWeight = 0.0, bool fromFile = false) const
+        {
+            // Sizes are only tracked when the cache is limited in bytes
+            if (m_d->m_maxCacheBytes <= 0)
+                valSize = 0;
+            else if (valSize < 0 || m_d->m_valueSizeFunction)
+                valSize = valueSize(*val);
             auto itemIter = m_d->m_itemsMap->find(key);
+            if (itemIter != m_d->m_itemsMap->end() && itemIter->isAvailable()) {
+                if (itemIter->isWriting() && !reclaimValue(*itemIter))
+                    return false;
+                releaseFileCopy(*itemIter);
+                itemIter->setVal(val.release());
+                m_d->m_cache->touch(itemIter->data());
+                m_d->m_cache->setSize(itemIter->data(), valSize);
+                return shrinkCache();
+            }
+            const ContainerObjectData<ValueType>* const incoming = itemIter == m_d->m_itemsMap->end() ? nullptr : itemIter->data();
+            while (isCacheFull(valSize)) {
+                if (!saveQueue(1, incoming))
+                    return false;
+            }
             if (itemIter == m_d->m_itemsMap->end()) {
-                m_d->m_itemsMap->insert(key, ContainerObject<ValueType>(val.release()));
+                itemIter = m_d->m_itemsMap->insert(key, ContainerObject<ValueType>(val.release()));
+            }
+            else if (fromFile) {
+                itemIter->setVal(val.release(), itemIter->fSize());
             }
             else {
-                if (!itemIter->isAvailable())
-                    removeFromMap(itemIter->fPos());
+                releaseFileCopy(*itemIter);
                 itemIter->setVal(val.release());
             }
+            itemIter->data()->m_cacheWeight = cacheWeight;
+            itemIter->data()->m_cacheSize = valSize;
+            m_d->cacheValue(itemIter->data(), key);
             return true;
         }
         QByteArray readBlock(const KeyType& key) const{
@@ -354,61 +3657,90 @@ namespace HugeContainers{
         }
         QByteArray readBlock(const KeyType& key, bool compressed) const
         {
-            if (Q_UNLIKELY(!m_d->m_device->isReadable()))
-                return QByteArray();
-            m_d->m_device->setTextModeEnabled(false);
             auto itemIter = m_d->m_itemsMap->constFind(key);
             Q_ASSERT(itemIter != m_d->m_itemsMap->constEnd());
-            Q_ASSERT(!itemIter->isAvailable());
-            auto fileIter = m_d->m_memoryMap->constFind(itemIter->fPos());
-            Q_ASSERT(fileIter != m_d->m_memoryMap->constEnd());
-            if (fileIter.value())
+            Q_ASSERT(itemIter->hasFileCopy());
+            // Inline copies are never compressed
+            if (itemIter->isInline())
+                return itemIter->inlineBlock();
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            if (Q_UNLIKELY(!m_d->m_device->isReadable()))
                 return QByteArray();
-            auto nextIter = fileIter + 1;
-            m_d->m_device->seek(fileIter.key());
-            QByteArray result;
-            if (nextIter == m_d->m_memoryMap->constEnd()) 
-                result = m_d->m_device->readAll();
-            else 
-                result = m_d->m_device->read(nextIter.key() - fileIter.key());
+            m_d->m_device->setTextModeEnabled(false);
+            const QByteArray result = m_d->readRange(itemIter->fPos(), itemIter->fSize());
             if (compressed)
                 return qUncompress(result);
             return result;
         }
+        // Records a hit on a cached value, used to replay accesses made while the container was only read
+        void touchValue(const KeyType& key) const
+        {
+            const auto itemIter = m_d->m_itemsMap->constFind(key);
+            if (itemIter == m_d->m_itemsMap->constEnd() || !itemIter->isAvailable() || itemIter->isWriting())
+                return;
+            m_d->m_cache->touch(itemIter->data());
+        }
+        // Finds the block holding the value of key so it can be read while other threads read the container.
+        // Returns false if the value is held in memory
+        bool blockRange(const KeyType& key, qint64& pos, qint64& size) const
+        {
+            const auto itemIter = m_d->m_itemsMap->constFind(key);
+            Q_ASSERT(itemIter != m_d->m_itemsMap->constEnd());
+            if (itemIter->isAvailable())
+                return false;
+            pos = itemIter->fPos();
+            size = itemIter->fSize();
+            return true;
+        }
+        // Moves a value decoded from the block at pos to the cache if that block still holds the value of key
+        bool installValue(const KeyType& key, qint64 pos, std::unique_ptr<ValueType>& val, qint64 blockSize, double cacheWeight) const
+        {
+            const auto itemIter = m_d->m_itemsMap->constFind(key);
+            if (itemIter == m_d->m_itemsMap->constEnd() || itemIter->isAvailable() || itemIter->fPos() != pos)
+                return false;
+            return enqueueValue(key, val, blockSize, cacheWeight, true);
+        }
     public:
         
+        // Unlike the iterators of QMap and QHash, iterators of HugeMap are invalidated by inserting a new key or removing any key
+        // other than through erase(), and those of HugeHash by inserting a new key. erase() returns a valid iterator to the following item
         class iterator
         {
             friend class HugeContainer;
             HugeContainer<KeyType, ValueType, sorted>* m_container;
             using BaseIterType = typename HugeContainerData<KeyType, ValueType, sorted>::ItemMapType::iterator;
             BaseIterType m_baseIter;
+            // Consecutive single steps, positive when moving forward and negative when moving backward
+            int m_sequentialSteps;
             iterator(HugeContainer<KeyType, ValueType, sorted>* const  cont, const BaseIterType& baseItr)
                 :m_container(cont)
                 , m_baseIter(baseItr)
+                , m_sequentialSteps(0)
             {}
         public:
             iterator()
                 :m_container(nullptr)
+                , m_sequentialSteps(0)
             {}
             iterator(const iterator& other) = default;
             iterator& operator=(const iterator& other) = default;
             iterator operator+(int j) const { return iterator(m_container, m_baseIter + j); }
-            iterator &operator++() { ++m_baseIter; return *this; }
-            iterator operator++(int) { iterator result(*this); ++m_baseIter; return result; }
-            iterator &operator+=(int j) { m_baseIter += j; return *this; }
+            iterator &operator++() { ++m_baseIter; m_sequentialSteps = qMax(0, m_sequentialSteps) + 1; return *this; }
+            iterator operator++(int) { iterator result(*this); operator++(); return result; }
+            iterator &operator+=(int j) { m_baseIter += j; m_sequentialSteps = 0; return *this; }
             iterator operator-(int j) const { return iterator(m_container, m_baseIter - j); }
-            iterator &operator--() { --m_baseIter; return *this; }
-            iterator operator--(int) { iterator result(*this); --m_baseIter; return result; }
-            iterator &operator-=(int j) { m_baseIter -= j; return *this; }
+            iterator &operator--() { --m_baseIter; m_sequentialSteps = qMin(0, m_sequentialSteps) - 1; return *this; }
+            iterator operator--(int) { iterator result(*this); operator--(); return result; }
+            iterator &operator-=(int j) { m_baseIter -= j; m_sequentialSteps = 0; return *this; }
             const KeyType& key() const { return m_baseIter.key(); }
             ValueType& operator*() const { return value(); }
             ValueType& value() const { 
+                m_container->prefetch(m_baseIter, m_sequentialSteps);
                 return m_container->operator[](key());
             }
             ValueType* operator->() const
             {
-                return &m_container->operator[](key());
+                return &value();
             }
             bool operator!=(const iterator &other) const { return !operator==(other); }
             bool operator==(const iterator &other) const { return m_container == other.m_container &&  m_baseIter == other.m_baseIter; }
@@ -422,33 +3754,38 @@ namespace HugeContainers{
             using BaseIterType = typename HugeContainerData<KeyType, ValueType, sorted>::ItemMapType::const_iterator;
             const HugeContainer<KeyType, ValueType, sorted>* m_container;
             BaseIterType m_baseIter;
+            // Consecutive single steps, positive when moving forward and negative when moving backward
+            int m_sequentialSteps;
             const_iterator(const HugeContainer<KeyType, ValueType, sorted>* const  cont, const BaseIterType& baseItr)
                 :m_container(cont)
                 , m_baseIter(baseItr)
+                , m_sequentialSteps(0)
             {}
         public:
             const_iterator() 
                 :m_container(nullptr)
+                , m_sequentialSteps(0)
             {}
             const_iterator(const const_iterator& other) = default;
             const_iterator& operator=(const const_iterator& other) = default;
             const_iterator operator+(int j) const { return const_iterator(m_container, m_baseIter + j); }
-            const_iterator &operator++() { ++m_baseIter; return *this; }
-            const_iterator operator++(int) { const_iterator result(*this); ++m_baseIter; return result; }
-            const_iterator &operator+=(int j) { m_baseIter += j; return *this; }
+            const_iterator &operator++() { ++m_baseIter; m_sequentialSteps = qMax(0, m_sequentialSteps) + 1; return *this; }
+            const_iterator operator++(int) { const_iterator result(*this); operator++(); return result; }
+            const_iterator &operator+=(int j) { m_baseIter += j; m_sequentialSteps = 0; return *this; }
             const_iterator operator-(int j) const { return const_iterator(m_container, m_baseIter - j); }
-            const_iterator &operator--() { --m_baseIter; return *this; }
-            const_iterator operator--(int) { const_iterator result(*this); --m_baseIter; return result; }
-            const_iterator &operator-=(int j) { m_baseIter -= j; return *this; }
+            const_iterator &operator--() { --m_baseIter; m_sequentialSteps = qMin(0, m_sequentialSteps) - 1; return *this; }
+            const_iterator operator--(int) { const_iterator result(*this); operator--(); return result; }
+            const_iterator &operator-=(int j) { m_baseIter -= j; m_sequentialSteps = 0; return *this; }
             const KeyType& key() const { return m_baseIter.key(); }
             const ValueType& operator*() const { return value(); }
             const ValueType& value() const
             {
+                m_container->prefetch(m_baseIter, m_sequentialSteps);
                 return  m_container->value(key());
             }
             const ValueType* operator->() const
             {
-                return &(m_container->value(key()));
+                return &value();
             }
             bool operator!=(const const_iterator &other) const { return !operator==(other); }
             bool operator==(const const_iterator &other) const { return m_container == other.m_container &&  m_baseIter == other.m_baseIter; }
@@ -505,39 +3842,226 @@ namespace HugeContainers{
                 prevIter = i;
             }
         }
-        HugeContainer(const NormalContaineType& list)
-            :HugeContainer()
-        {
-            for (auto i = list.constBegin(); i != list.constEnd(); ++i) {
-                if (contains(i.key()))
-                    continue;
-                insert(i.key(), i.value());
-            }
+        HugeContainer(const NormalContaineType& list)
+            :HugeContainer()
+        {
+            for (auto i = list.constBegin(); i != list.constEnd(); ++i) {
+                if (contains(i.key()))
+                    continue;
+                insert(i.key(), i.value());
+            }
+        }
+        QList<KeyType> keys() const
+        {
+            return m_d->m_itemsMap->keys();
+        }
+        QList<KeyType> uniqueKeys() const
+        {
+            Q_ASSERT(m_d->m_itemsMap->keys() == m_d->m_itemsMap->uniqueKeys());
+            return keys();
+        }
+        int maxCache() const {
+            return m_d->m_maxCache;
+        }
+        bool setMaxCache(int val) { 
+            val = qMax(1, val);
+            if (val == m_d->m_maxCache)
+                return true;
+            m_d.detach();
+            m_d->m_maxCache = val;
+            if (m_d->m_maxCacheBytes > 0)
+                return true;
+            m_d->m_cache->setCapacity(val);
+            return shrinkCache();
+        }
+        qint64 maxCacheBytes() const {
+            return m_d->m_maxCacheBytes;
+        }
+        // If val is greater than 0 the cache is limited by the total size of the values it holds instead of by maxCache()
+        bool setMaxCacheBytes(qint64 val) {
+            val = qMax(Q_INT64_C(0), val);
+            if (val == m_d->m_maxCacheBytes)
+                return true;
+            m_d.detach();
+            m_d->m_maxCacheBytes = val;
+            m_d->m_cache->updateSizes([this](const ValueType& cachedVal) -> qint64 { return cachedSize(cachedVal); });
+            m_d->m_cache->setCapacity(val > 0 ? 0 : m_d->m_maxCache);
+            return shrinkCache();
+        }
+        // Size of the values in the cache, only tracked when maxCacheBytes() is greater than 0
+        qint64 cacheBytes() const {
+            measureChangedValues();
+            return m_d->m_cache->bytes();
+        }
+        // Sets the function used to compute the size of a value when the cache is limited in bytes. By default the serialized size is used
+        bool setValueSizeFunction(const std::function<qint64(const ValueType&)>& sizeFunction) {
+            m_d.detach();
+            m_d->m_valueSizeFunction = sizeFunction;
+            if (m_d->m_maxCacheBytes <= 0)
+                return true;
+            m_d->m_cache->updateSizes([this](const ValueType& cachedVal) -> qint64 { return cachedSize(cachedVal); });
+            return shrinkCache();
+        }
+        qint64 maxWriteQueueBytes() const {
+            return m_d->m_writeQueue->maxBytes();
+        }
+        // If val is greater than 0 values evicted from the cache are written by a background thread,
+        // eviction only blocks while more than val bytes are waiting to be written
+        bool setMaxWriteQueueBytes(qint64 val) {
+            val = qMax(Q_INT64_C(0), val);
+            if (val == m_d->m_writeQueue->maxBytes())
+                return true;
+            m_d.detach();
+            if (val == 0)
+                m_d->settleWrites();
+            m_d->m_writeQueue->setMaxBytes(val);
+            return true;
+        }
+        bool isMemoryMapped() const {
+            return m_d->m_memoryMapped;
+        }
+        // If val is true values are decoded directly from a memory mapping of the file instead of being copied out of it
+        bool setMemoryMapped(bool val) {
+            if (val == m_d->m_memoryMapped)
+                return true;
+            m_d.detach();
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            m_d->m_memoryMapped = val;
+            if (!val)
+                m_d->unmapFile();
+            return true;
+        }
+        int readAhead() const {
+            return m_d->m_readAhead;
+        }
+        // Number of items iterators read from the file in a single pass when they move sequentially. 0 disables read ahead.
+        // The values read ahead are kept within maxCache() or maxCacheBytes() together with the cached ones
+        bool setReadAhead(int val) {
+            val = qMax(0, val);
+            if (val == m_d->m_readAhead)
+                return true;
+            m_d.detach();
+            m_d->m_readAhead = val;
+            m_d->m_readAheadValues.clear();
+            return true;
+        }
+        int inlineSize() const {
+            return m_d->m_inlineSize;
+        }
+        // Values whose serialized form takes at most val bytes are kept in memory, uncompressed, when they leave the cache instead of being written to the file.
+        // These copies don't count against the limits of the cache, the values are decoded from them when they are read. 0 disables it
+        bool setInlineSize(int val) {
+            if (val < 0)
+                return false;
+            if (val == m_d->m_inlineSize)
+                return true;
+            m_d.detach();
+            m_d->m_inlineSize = val;
+            return true;
+        }
+        double slotHeadroom() const {
+            return m_d->m_slotHeadroom;
         }
-        QList<KeyType> keys() const
-        {
-            return m_d->m_itemsMap->keys();
+        // Extra space reserved after each value written to the file, as a fraction of its size.
+        // A modified value that still fits in its block is written back in place
+        bool setSlotHeadroom(double val) {
+            val = qMax(0.0, val);
+            if (val == m_d->m_slotHeadroom)
+                return true;
+            m_d.detach();
+            m_d->m_slotHeadroom = val;
+            return true;
         }
-        QList<KeyType> uniqueKeys() const
-        {
-            Q_ASSERT(m_d->m_itemsMap->keys() == m_d->m_itemsMap->uniqueKeys());
-            return keys();
+        qint64 growthChunk() const {
+            return m_d->m_growthChunk;
         }
-        int maxCache() const {
-            return m_d->m_maxCache;
+        // The file is extended by multiples of val, allocated on the disk in advance, instead of growing by each value written at its end.
+        // 0 disables it
+        bool setGrowthChunk(qint64 val) {
+            val = qMax(Q_INT64_C(0), val);
+            if (val == m_d->m_growthChunk)
+                return true;
+            m_d.detach();
+            m_d->m_growthChunk = val;
+            return true;
         }
-        bool setMaxCache(int val) { 
-            val = qMax(1, val);
-            if (val == m_d->m_maxCache)
+        qint64 pageSize() const {
+            return m_d->m_pageSize;
+        }
+        // Packs the blocks of at most a quarter of val bytes in pages of val bytes, freed with their last value.
+        // 0 disables it, pages are not used in log-structured mode
+        bool setPageSize(qint64 val) {
+            if (val < 0)
+                return false;
+            if (val == m_d->m_pageSize)
                 return true;
             m_d.detach();
-            if (val < m_d->m_cache->size()) {
-                if (!saveQueue(m_d->m_cache->size() - val))
-                    return false;
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            m_d->m_pageSize = val;
+            return true;
+        }
+        qint64 segmentSize() const {
+            return m_d->m_segmentSize;
+        }
+        // Log-structured mode for write heavy use: values are always written at the head of the log, never in place. Segments of segmentSize
+        // bytes whose live data falls below liveRatio are rewritten at the head after changes so they become free. 0 disables it
+        bool setLogStructured(qint64 segmentSize, double liveRatio = 0.5) {
+            if (segmentSize < 0 || liveRatio < 0.0 || liveRatio >= 1.0)
+                return false;
+            m_d.detach();
+            m_d->settleWrites();
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            m_d->m_segmentSize = segmentSize;
+            m_d->m_segmentLiveRatio = liveRatio;
+            m_d->rebuildSegments();
+            return true;
+        }
+        // Rewrites all the segments whose live data is below the ratio set by setLogStructured(), except the ones the log
+        // and the file end in. Returns the number of bytes moved, -1 if a block could not be moved
+        qint64 collectGarbage() {
+            if (m_d->m_segmentSize <= 0)
+                return 0;
+            m_d->settleWrites();
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            QSet<qint64> candidates;
+            for (auto i = m_d->m_gcCandidates.cbegin(); i != m_d->m_gcCandidates.cend(); ++i) {
+                if (!isActiveSegment(*i))
+                    candidates.insert(*i);
             }
-            m_d->m_maxCache = val;
+            qint64 result = 0;
+            for (auto i = candidates.begin(); i != candidates.end(); ++i) {
+                if (!m_d->m_gcCandidates.contains(*i))
+                    continue;
+                const qint64 moved = collectSegment(*i);
+                if (moved < 0)
+                    return -1;
+                result += moved;
+            }
+            return result;
+        }
+        // Compacts the file stepBytes at a time after changes, from when fragmentation() reaches highWatermark until it falls to lowWatermark.
+        // Files smaller than minFileSize are left alone. A highWatermark of 0 disables it
+        bool setAutoCompaction(double highWatermark, double lowWatermark = 0.0, qint64 minFileSize = 0, qint64 stepBytes = 1 << 20) {
+            if (highWatermark < 0.0 || highWatermark > 1.0 || lowWatermark < 0.0 || lowWatermark > highWatermark || stepBytes <= 0)
+                return false;
+            m_d.detach();
+            m_d->m_compactionHigh = highWatermark;
+            m_d->m_compactionLow = lowWatermark;
+            m_d->m_compactionMinSize = minFileSize;
+            m_d->m_compactionStep = stepBytes;
+            m_d->m_compacting = false;
             return true;
         }
+        CachePolicy cachePolicy() const {
+            return m_d->m_cache->policy();
+        }
+        void setCachePolicy(CachePolicy val) {
+            if (val == m_d->m_cache->policy())
+                return;
+            m_d.detach();
+            m_d->m_cache->setPolicy(val);
+            m_d->releaseGhosts();
+        }
         
         void swap(HugeContainer<KeyType, ValueType, sorted>& other) Q_DECL_NOTHROW{
             std::swap(m_d, other.m_d);
@@ -550,19 +4074,19 @@ namespace HugeContainers{
             m_d.detach();
             auto itemIter = m_d->m_itemsMap->find(key);
             Q_ASSERT(itemIter != m_d->m_itemsMap->end());
-            m_d->m_cache->removeAll(key);
-            if (!itemIter->isAvailable())
-                removeFromMap(itemIter->fPos());
+            discardValue(*itemIter);
             m_d->m_itemsMap->erase(itemIter);
+            maintainFile();
             return true;
         }
         iterator insert(const KeyType &key, const ValueType &val)
         {
             m_d.detach();
             auto tempval = std::make_unique<ValueType>(val);
-            if (enqueueValue(key, tempval))
-                return find(key);
-            return end();
+            if (!enqueueValue(key, tempval))
+                return end();
+            maintainFile();
+            return find(key);
         }
         iterator insert(const KeyType &key, ValueType* val)
         {
@@ -570,9 +4094,174 @@ namespace HugeContainers{
                 return end();
             m_d.detach();
             std::unique_ptr<ValueType> tempval(val);
-            if (enqueueValue(key, tempval))
-                return find(key);
-            return end();
+            if (!enqueueValue(key, tempval))
+                return end();
+            maintainFile();
+            return find(key);
+        }
+        // Inserts the pairs in [first, last). If a key appears more than once the last value is kept
+        template <class InputIterator>
+        typename std::enable_if<!std::is_convertible<InputIterator, KeyType>::value, bool>::type insert(InputIterator first, InputIterator last)
+        {
+            QVector<QPair<KeyType, ValueType> > items;
+            for (; first != last; ++first)
+                items.append(qMakePair(first->first, first->second));
+            return insertBatch(items);
+        }
+        // Inserts all the items at once. The items that don't fit in the cache and the values they evict
+        // are written to the end of the file in a single write. If a key appears more than once the last value is kept
+        bool insertBatch(const QVector<QPair<KeyType, ValueType> >& items)
+        {
+            if (items.isEmpty())
+                return true;
+            m_d.detach();
+            m_d->collectWrites();
+            QVector<int> batchOrder;
+            {
+                typename std::conditional<sorted, QMap<KeyType, int>, QHash<KeyType, int> >::type lastIndex;
+                for (int i = 0; i < items.size(); ++i)
+                    lastIndex[items.at(i).first] = i;
+                batchOrder.reserve(lastIndex.size());
+                for (int i = 0; i < items.size(); ++i) {
+                    if (lastIndex.value(items.at(i).first) == i)
+                        batchOrder.append(i);
+                }
+            }
+            // The values being replaced are only discarded once the batch is written, their room in the cache is already counted as free
+            QSet<const ContainerObjectData<ValueType>*> replaced;
+            qint64 replacedBytes = 0;
+            for (auto i = batchOrder.cbegin(); i != batchOrder.cend(); ++i) {
+                const auto itemIter = m_d->m_itemsMap->constFind(items.at(*i).first);
+                if (itemIter != m_d->m_itemsMap->constEnd() && itemIter->data() && m_d->m_cache->isCached(itemIter->data())) {
+                    replaced.insert(itemIter->data());
+                    replacedBytes += itemIter->data()->m_cacheSize;
+                }
+            }
+            // The last items go to the cache
+            int firstCached = batchOrder.size();
+            qint64 cachedBytes = 0;
+            QVector<qint64> cachedSizes;
+            if (m_d->m_maxCacheBytes > 0) {
+                while (firstCached > 0) {
+                    const qint64 valSize = valueSize(items.at(batchOrder.at(firstCached - 1)).second);
+                    if (firstCached < batchOrder.size() && cachedBytes + valSize > m_d->m_maxCacheBytes)
+                        break;
+                    cachedBytes += valSize;
+                    cachedSizes.prepend(valSize);
+                    --firstCached;
+                }
+            }
+            else {
+                firstCached = qMax(0, firstCached - m_d->m_maxCache);
+                cachedSizes.fill(0, batchOrder.size() - firstCached);
+            }
+            // Make room in the cache
+            QVector<ContainerObjectData<ValueType>*> victims;
+            QVector<ContainerObjectData<ValueType>*> replacedVictims;
+            while (m_d->m_cache->size() > replaced.size()) {
+                if (m_d->m_maxCacheBytes > 0) {
+                    if (m_d->m_cache->bytes() - replacedBytes + cachedBytes <= m_d->m_maxCacheBytes)
+                        break;
+                }
+                else if (m_d->m_cache->size() - replaced.size() + batchOrder.size() - firstCached <= m_d->m_maxCache) {
+                    break;
+                }
+                ContainerObjectData<ValueType>* const victim = m_d->m_cache->takeVictim();
+                QByteArray block;
+                if (replaced.remove(victim)) {
+                    // It's about to be replaced, there is no point in writing it
+                    replacedBytes -= victim->m_cacheSize;
+                    replacedVictims.append(victim);
+                }
+                else if (!victim->isDirty()) {
+                    victim->setFPos(victim->m_fPos, victim->m_fSize);
+                    m_d->recordWrite(victim, true);
+                }
+                else if (encodeInline(*(victim->m_val), block)) {
+                    storeInline(victim, block);
+                    m_d->recordWrite(victim, true);
+                }
+                else
+                    victims.append(victim);
+            }
+            QByteArray blocks;
+            QVector<int> blockSizes;
+            blockSizes.reserve(victims.size() + firstCached);
+            for (auto i = victims.cbegin(); i != victims.cend(); ++i) {
+                const QByteArray block = HugeContainerData<KeyType, ValueType, sorted>::serializeValue(*((*i)->m_val), m_d->m_compressionLevel);
+                blocks.append(block);
+                blockSizes.append(block.size());
+            }
+            // Small items are kept inline instead of being written
+            QVector<QByteArray> inlineBlocks(firstCached);
+            for (int i = 0; i < firstCached; ++i) {
+                QByteArray block;
+                if (encodeInline(items.at(batchOrder.at(i)).second, block)) {
+                    inlineBlocks[i] = block;
+                    continue;
+                }
+                block = block.isNull() ? HugeContainerData<KeyType, ValueType, sorted>::serializeValue(items.at(batchOrder.at(i)).second, m_d->m_compressionLevel) : HugeContainerData<KeyType, ValueType, sorted>::compressBlock(block, m_d->m_compressionLevel);
+                blocks.append(block);
+                blockSizes.append(block.size());
+            }
+            qint64 blockPos = 0;
+            if (!blocks.isEmpty()) {
+                QMutexLocker fileLocker(&m_d->m_fileMutex);
+                blockPos = m_d->appendInMap(blocks, blockSizes);
+                // The stale blocks of the evicted values are replaced by the new ones
+                for (auto i = victims.cbegin(); blockPos >= 0 && i != victims.cend(); ++i) {
+                    if ((*i)->m_fPos >= 0)
+                        m_d->freeInMap((*i)->m_fPos);
+                }
+            }
+            if (blockPos < 0) {
+                for (auto i = victims.cbegin(); i != victims.cend(); ++i)
+                    m_d->m_cache->restore(*i);
+                for (auto i = replacedVictims.cbegin(); i != replacedVictims.cend(); ++i)
+                    m_d->m_cache->restore(*i);
+                return false;
+            }
+            auto sizeIter = blockSizes.cbegin();
+            for (auto i = victims.cbegin(); i != victims.cend(); ++i, ++sizeIter) {
+                (*i)->setFPos(blockPos, *sizeIter);
+                m_d->recordWrite(*i, true);
+                blockPos += *sizeIter;
+            }
+            for (int i = 0; i < batchOrder.size(); ++i) {
+                const QPair<KeyType, ValueType>& item = items.at(batchOrder.at(i));
+                auto itemIter = m_d->m_itemsMap->find(item.first);
+                if (itemIter != m_d->m_itemsMap->end()) {
+                    discardValue(*itemIter);
+                    itemIter->relocate(-1, -1);
+                }
+                if (i < firstCached && !inlineBlocks.at(i).isNull()) {
+                    if (itemIter == m_d->m_itemsMap->end())
+                        m_d->m_itemsMap->insert(item.first, ContainerObject<ValueType>(inlineBlocks.at(i)));
+                    else
+                        itemIter->setInline(inlineBlocks.at(i));
+                    continue;
+                }
+                if (i < firstCached) {
+                    if (itemIter == m_d->m_itemsMap->end())
+                        m_d->m_itemsMap->insert(item.first, ContainerObject<ValueType>(blockPos, *sizeIter));
+                    else {
+                        itemIter->setFPos(blockPos, *sizeIter);
+                        itemIter->flatten();
+                    }
+                    setBlockOwner(blockPos, item.first);
+                    blockPos += *(sizeIter++);
+                    continue;
+                }
+                if (itemIter == m_d->m_itemsMap->end())
+                    itemIter = m_d->m_itemsMap->insert(item.first, ContainerObject<ValueType>(new ValueType(item.second)));
+                else
+                    itemIter->setVal(new ValueType(item.second));
+                itemIter->data()->m_cacheWeight = 0.0;
+                itemIter->data()->m_cacheSize = cachedSizes.at(i - firstCached);
+                m_d->cacheValue(itemIter->data(), item.first);
+            }
+            maintainFile();
+            return true;
         }
         const KeyType& key(const ValueType& val) const{
             const auto itemMapEnd = m_d->m_itemsMap->constEnd();
@@ -596,13 +4285,23 @@ namespace HugeContainers{
             if (isEmpty())
                 return;
             m_d.detach();
-            if (!m_d->m_device->resize(0)) {
+            // The background writer must be done with the file before it's truncated
+            m_d->m_writeQueue->clear();
+            ++m_d->m_fileGeneration;
+            if (!m_d->resizeFile(0)) {
                 Q_ASSERT_X(false, "HugeContainer::HugeContainer", "Unable to resize temporary file");
             }
+            m_d->m_readAheadValues.clear();
+            m_d->m_cache->clear();
+            m_d->m_cachedKeys.clear();
             m_d->m_itemsMap->clear();
             m_d->m_memoryMap->clear();
             m_d->m_memoryMap->insert(0, true);
-            m_d->m_cache->clear();
+            m_d->m_freeBlocks.clear();
+            m_d->m_freeBytes = 0;
+            m_d->rebuildSegments();
+            m_d->clearPages();
+            m_d->untrackOwners();
         }
 
         ValueType value(const KeyType& key, const ValueType& defaultValue) const{
@@ -615,14 +4314,15 @@ namespace HugeContainers{
             auto valueIter = m_d->m_itemsMap->find(key);
             Q_ASSERT(valueIter != m_d->m_itemsMap->end());
             if(!valueIter->isAvailable()){
-                auto result = valueFromBlock(key);
-                Q_ASSERT(result);
-                const bool enqueueRes = enqueueValue(key, result);
-                Q_ASSERT(enqueueRes);
+                const bool loadRes = loadValue(key);
+                Q_ASSERT(loadRes);
+            }
+            else if (valueIter->isWriting()) {
+                const bool loadRes = reclaimValue(*valueIter);
+                Q_ASSERT(loadRes);
             }
             else {
-                m_d->m_cache->removeAll(key);
-                m_d->m_cache->enqueue(key);
+                m_d->m_cache->touch(valueIter->data());
             }
             return *(valueIter->val());
         }
@@ -636,15 +4336,20 @@ namespace HugeContainers{
             }
             Q_ASSERT(valueIter != m_d->m_itemsMap->end());
             if (!valueIter->isAvailable()) {
-                auto result = valueFromBlock(key);
-                Q_ASSERT(result);
-                const bool enqueueRes = enqueueValue(key, result);
-                Q_ASSERT(enqueueRes);
+                const bool loadRes = loadValue(key);
+                Q_ASSERT(loadRes);
+            }
+            else if (valueIter->isWriting()) {
+                const bool loadRes = reclaimValue(*valueIter);
+                Q_ASSERT(loadRes);
             }
             else {
-                m_d->m_cache->removeAll(key);
-                m_d->m_cache->enqueue(key);
+                m_d->m_cache->touch(valueIter->data());
             }
+            // The value can be modified through the returned reference
+            releaseFileCopy(*valueIter);
+            if (m_d->m_maxCacheBytes > 0)
+                m_d->m_cache->markChanged(valueIter->data());
             return *(valueIter->val());
         }
         ValueType operator[](const KeyType& key) const{
@@ -677,64 +4382,73 @@ namespace HugeContainers{
                     continue;
                 if(neverDetatched){
                     m_d.detach();
+                    m_d->settleWrites();
                     currItmIter = m_d->m_itemsMap->find(oterItmIter.key());
                     neverDetatched = false;
                 }
                 if (oterItmIter->isAvailable()) {
                     if (currItmIter != m_d->m_itemsMap->end()) { // contains(i.key())
-                        if (m_d->m_cache->contains(oterItmIter.key())) {
-                            Q_ASSERT(currItmIter->isAvailable());
+                        if (currItmIter->isAvailable()) {
+                            releaseFileCopy(*currItmIter);
                             currItmIter->setVal(new ValueType(*(oterItmIter->val())));
+                            m_d->m_cache->setSize(currItmIter->data(), cachedSize(*(currItmIter->val())));
                         }
                         else {
                             Q_ASSERT(!currItmIter->isAvailable());
-                            const qint64 newPos = writeElementInMap(*(oterItmIter->val()));
-                            if (newPos >= 0)
-                                removeFromMap(currItmIter->fPos());
-                            else
+                            const QByteArray block = HugeContainerData<KeyType, ValueType, sorted>::serializeValue(*(oterItmIter->val()), m_d->m_compressionLevel);
+                            const qint64 newPos = writeInMap(block);
+                            if (newPos < 0)
                                 return false;
-                            currItmIter->setFPos(newPos);
+                            discardValue(*currItmIter);
+                            currItmIter->setFPos(newPos, block.size());
+                            currItmIter->flatten();
+                            setBlockOwner(newPos, oterItmIter.key());
                         }
                     }
                     else{
-                        const qint64 newPos = writeElementInMap(*(oterItmIter->val()));
-                        if (newPos >= 0)
-                            m_d->m_itemsMap->insert(oterItmIter.key(), ContainerObject<ValueType>(newPos));
-                        else
+                        const QByteArray block = HugeContainerData<KeyType, ValueType, sorted>::serializeValue(*(oterItmIter->val()), m_d->m_compressionLevel);
+                        const qint64 newPos = writeInMap(block);
+                        if (newPos < 0)
                             return false;
+                        m_d->m_itemsMap->insert(oterItmIter.key(), ContainerObject<ValueType>(newPos, block.size()));
+                        setBlockOwner(newPos, oterItmIter.key());
                     }
                 }
                 else{
                     if (currItmIter != m_d->m_itemsMap->end()) {
                         if (currItmIter->isAvailable()) {
-                            Q_ASSERT(m_d->m_cache->contains(oterItmIter.key()));
                             auto newVal = other.valueFromBlock(oterItmIter.key());
                             if (!newVal)
                                 return false;
+                            releaseFileCopy(*currItmIter);
                             currItmIter->setVal(newVal.release());
+                            m_d->m_cache->setSize(currItmIter->data(), cachedSize(*(currItmIter->val())));
                         }
                         else{
                             Q_ASSERT(!currItmIter->isAvailable());
-                            const qint64 newPos = writeInMap(other.readBlock(oterItmIter.key()));
-                            if (newPos >= 0)
-                                removeFromMap(currItmIter->fPos());
-                            else
+                            const QByteArray block = HugeContainerData<KeyType, ValueType, sorted>::compressBlock(other.readBlock(oterItmIter.key()), m_d->m_compressionLevel);
+                            const qint64 newPos = writeInMap(block);
+                            if (newPos < 0)
                                 return false;
-                            currItmIter->setFPos(newPos);
+                            discardValue(*currItmIter);
+                            currItmIter->setFPos(newPos, block.size());
+                            currItmIter->flatten();
+                            setBlockOwner(newPos, oterItmIter.key());
                         }
                         
                     }
                     else{
-                        const qint64 newPos = writeInMap(other.readBlock(oterItmIter.key()));
-                        if (newPos >= 0)
-                            m_d->m_itemsMap->insert(oterItmIter.key(), ContainerObject<ValueType>(newPos));
-                        else
+                        const QByteArray block = HugeContainerData<KeyType, ValueType, sorted>::compressBlock(other.readBlock(oterItmIter.key()), m_d->m_compressionLevel);
+                        const qint64 newPos = writeInMap(block);
+                        if (newPos < 0)
                             return false;
+                        m_d->m_itemsMap->insert(oterItmIter.key(), ContainerObject<ValueType>(newPos, block.size()));
+                        setBlockOwner(newPos, oterItmIter.key());
                     }
                 }
 
             }
-            return true;
+            return shrinkCache();
         }
         bool contains(const KeyType& key) const
         {
@@ -748,8 +4462,17 @@ namespace HugeContainers{
         {
             return m_d->m_itemsMap->size();
         }
+        // Size of the data in the file, the space allocated in advance by setGrowthChunk() is not counted
         qint64 fileSize() const{
-            return m_d->m_device->size();
+            m_d->settleWrites();
+            return m_d->m_memoryMap->lastKey();
+        }
+        // Space the file takes on the disk. It's less than fileSize() when freed blocks were released to the filesystem
+        // and more when space was allocated in advance
+        qint64 diskUsage() const{
+            m_d->settleWrites();
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            return m_d->diskUsage();
         }
         bool isEmpty() const
         {
@@ -810,14 +4533,41 @@ namespace HugeContainers{
         {
             return const_iterator(this, m_d->m_itemsMap->constFind(val));
         }
+        // Only available in HugeMap
+        iterator lowerBound(const KeyType& key)
+        {
+            return iterator(this, m_d->m_itemsMap->lowerBound(key));
+        }
+        const_iterator lowerBound(const KeyType& key) const
+        {
+            return const_iterator(this, m_d->m_itemsMap->lowerBound(key));
+        }
+        iterator upperBound(const KeyType& key)
+        {
+            return iterator(this, m_d->m_itemsMap->upperBound(key));
+        }
+        const_iterator upperBound(const KeyType& key) const
+        {
+            return const_iterator(this, m_d->m_itemsMap->upperBound(key));
+        }
+        // Only available in HugeHash. Sizes the index for size keys so it's not rehashed while they are inserted
+        void reserve(int size)
+        {
+            m_d.detach();
+            m_d->m_itemsMap->reserve(size);
+        }
         iterator erase(iterator pos)
         {
             Q_ASSERT(pos.m_container == this);
             if (pos == end())
                 return pos;
             m_d.detach();
-            const auto result = pos + 1;
-            remove(pos.key());
+            // The index may move the following items when one is erased
+            const auto itemIter = m_d->m_itemsMap->find(pos.key());
+            Q_ASSERT(itemIter != m_d->m_itemsMap->end());
+            discardValue(*itemIter);
+            const iterator result(this, m_d->m_itemsMap->erase(itemIter));
+            maintainFile();
             return result;
         }
         ValueType take(const KeyType& key)
@@ -886,23 +4636,95 @@ namespace HugeContainers{
                 result.append(i.value());
             return result;
         }
+        // Returns the values of keys in the same order, a default constructed value for missing keys. Values in the file are read in file order
+        // without entering the cache and decoded on pool if it's not null. pool must not be waiting on the calling thread
+        QList<ValueType> values(const QList<KeyType>& keys, QThreadPool* pool = nullptr) const
+        {
+            QList<ValueType> result;
+            result.reserve(keys.size());
+            // Positions in the file of the values to read and the indexes in result they go to
+            QHash<qint64, QVector<int> > fileItems;
+            QVector<QPair<qint64, int> > positions;
+            for (int i = 0; i < keys.size(); ++i) {
+                const auto itemIter = m_d->m_itemsMap->constFind(keys.at(i));
+                if (itemIter == m_d->m_itemsMap->constEnd()) {
+                    result.append(ValueType());
+                    continue;
+                }
+                if (itemIter->isAvailable()) {
+                    if (!itemIter->isWriting())
+                        m_d->m_cache->touch(itemIter->data());
+                    result.append(*(itemIter->val()));
+                    continue;
+                }
+                if (itemIter->isInline()) {
+                    result.append(ValueType());
+                    HugeContainerData<KeyType, ValueType, sorted>::decodeValue(itemIter->inlineBlock(), result.last());
+                    continue;
+                }
+                const auto aheadIter = m_d->m_readAheadValues.constFind(itemIter->fPos());
+                if (aheadIter != m_d->m_readAheadValues.constEnd()) {
+                    result.append(aheadIter.value());
+                    continue;
+                }
+                QVector<int>& indexes = fileItems[itemIter->fPos()];
+                if (indexes.isEmpty())
+                    positions.append(qMakePair(itemIter->fPos(), itemIter->fSize()));
+                indexes.append(i);
+                result.append(ValueType());
+            }
+            if (fileItems.isEmpty())
+                return result;
+            std::sort(positions.begin(), positions.end());
+            QVector<QByteArray> runs;
+            const QVector<QPair<qint64, QByteArray> > blocks = readBlocks(positions, runs);
+            QVector<ValueType> decoded(blocks.size());
+            const bool compressed = m_d->m_compressionLevel != 0;
+            const int numTasks = pool ? qMin(blocks.size(), pool->maxThreadCount()) : 0;
+            if (numTasks > 1) {
+                QSemaphore done;
+                for (int i = 0; i < numTasks; ++i)
+                    pool->start(new DecodeTask(blocks, blocks.size() * i / numTasks, blocks.size() * (i + 1) / numTasks, compressed, decoded, done));
+                done.acquire(numTasks);
+            }
+            else {
+                for (int i = 0; i < blocks.size(); ++i)
+                    decodeBlock(blocks.at(i).second, compressed, decoded[i]);
+            }
+            for (int i = 0; i < blocks.size(); ++i) {
+                const QVector<int> indexes = fileItems.value(blocks.at(i).first);
+                for (auto j = indexes.cbegin(); j != indexes.cend(); ++j)
+                    result[*j] = decoded.at(i);
+            }
+            return result;
+        }
+        // True if the automatic compaction or garbage collection after the last change could not move a block, the values are left intact
+        bool maintenanceFailed() const {
+            return m_d->m_maintenanceFailed;
+        }
         double fragmentation() const{
-            if (m_d->m_memoryMap->size() <= 1)
+            m_d->settleWrites();
+            const qint64 usedSize = m_d->m_memoryMap->lastKey();
+            if (usedSize == 0)
                 return 0.0;
-            qint64 result = 0.0;
-            const auto endIter = m_d->m_memoryMap->constEnd() - 1;
-            for (auto i = m_d->m_memoryMap->constBegin(); i != endIter ; ++i) {
-                if (i.value())
-                    result += (i + 1).key() - i.key();
-            }
-            return static_cast<double>(result) / static_cast<double>(endIter.key());
+            return static_cast<double>(m_d->m_freeBytes) / static_cast<double>(usedSize);
         }
         
         bool defrag(){
-            if (std::all_of(m_d->m_memoryMap->constBegin(), m_d->m_memoryMap->constEnd() - 1, [](bool val) ->bool {return !val; }))
+            m_d->settleWrites();
+            // Nothing to do if there are no holes and no stale blocks reserved to modified values
+            if (m_d->m_freeBlocks.empty() && std::none_of(m_d->m_itemsMap->constBegin(), m_d->m_itemsMap->constEnd(), [](const ContainerObject<ValueType>& item) ->bool {return item.fPos() >= 0 && !item.hasFileCopy(); }))
                 return true;
             return defrag(m_d->m_compressionLevel != 0, m_d->m_compressionLevel);
         }
+        // Shrinks the file by moving at most maxBytes, or a single bigger block, from its end into holes or sliding them down into the first one.
+        // Returns the number of bytes moved, 0 if there is nothing to compact, -1 if a block could not be moved
+        qint64 compact(qint64 maxBytes)
+        {
+            m_d->settleWrites();
+            QMutexLocker fileLocker(&m_d->m_fileMutex);
+            return compactFile(maxBytes);
+        }
         bool operator==(const HugeContainer<KeyType, ValueType,sorted>& other)const{
             if(size()!=other.size())
                 return false;
@@ -930,11 +4752,407 @@ namespace HugeContainers{
         friend QDataStream& (::operator<<)(QDataStream &out, const HugeContainers::HugeContainer<KeyType, ValueType, sorted>& cont);
         template<class KeyType, class ValueType, bool sorted>
         friend QDataStream& (::operator>>)(QDataStream &in, HugeContainers::HugeContainer<KeyType, ValueType, sorted>& cont);
+        template<class KeyType, class ValueType>
+        friend class ConcurrentHugeHash;
     };
     template <class KeyType, class ValueType>
     using HugeMap = HugeContainer<KeyType, ValueType, true>;
     template <class KeyType, class ValueType>
     using HugeHash = HugeContainer<KeyType, ValueType, false>;
+
+    // Hash that can be used by several threads at the same time. Items are split in shards by the hash of their key,
+    // each with its own index, cache, file and reader/writer lock. Values are decoded without holding the lock
+    template <class KeyType, class ValueType>
+    class ConcurrentHugeHash
+    {
+        Q_DISABLE_COPY(ConcurrentHugeHash)
+        using ContainerData = typename HugeHash<KeyType, ValueType>::template HugeContainerData<KeyType, ValueType, false>;
+        struct ReadValue
+        {
+            KeyType m_key;
+            qint64 m_blockPos;
+            qint64 m_blockSize;
+            quint64 m_generation;
+            double m_cacheWeight;
+            std::unique_ptr<ValueType> m_val;
+        };
+        class Shard
+        {
+        public:
+            QReadWriteLock m_lock;
+            // Held for reading while the file is read without m_lock and for writing while the file is replaced.
+            // Always locked before m_lock
+            QReadWriteLock m_fileLock;
+            HugeHash<KeyType, ValueType> m_container;
+            // Hits on cached values while holding the read lock, replayed on the cache the next time the shard is written.
+            // Values read from the file while another thread held the shard wait in m_readValues to be cached the same way
+            QMutex m_hitsMutex;
+            QVector<KeyType> m_hits;
+            std::vector<ReadValue> m_readValues;
+        };
+        std::vector<std::unique_ptr<Shard> > m_shards;
+        Shard& shard(const KeyType& key) const
+        {
+            return *(m_shards[qHash(key) & (m_shards.size() - 1)]);
+        }
+        static void recordHit(Shard& sh, const KeyType& key)
+        {
+            // Hits are dropped rather than making readers wait
+            if (!sh.m_hitsMutex.tryLock())
+                return;
+            if (sh.m_hits.size() < 64)
+                sh.m_hits.append(key);
+            sh.m_hitsMutex.unlock();
+        }
+        static void recordValue(Shard& sh, ReadValue&& readValue)
+        {
+            if (!sh.m_hitsMutex.tryLock())
+                return;
+            if (sh.m_readValues.size() < 64)
+                sh.m_readValues.push_back(std::move(readValue));
+            sh.m_hitsMutex.unlock();
+        }
+        // The caller must hold the write lock of sh
+        static void replayHits(Shard& sh)
+        {
+            QVector<KeyType> hits;
+            std::vector<ReadValue> readValues;
+            {
+                QMutexLocker hitsLocker(&sh.m_hitsMutex);
+                hits.swap(sh.m_hits);
+                readValues.swap(sh.m_readValues);
+            }
+            for (auto i = readValues.begin(); i != readValues.end(); ++i) {
+                if (sh.m_container.m_d->m_fileGeneration == i->m_generation)
+                    sh.m_container.installValue(i->m_key, i->m_blockPos, i->m_val, i->m_blockSize, i->m_cacheWeight);
+            }
+            for (auto i = hits.cbegin(); i != hits.cend(); ++i)
+                sh.m_container.touchValue(*i);
+        }
+        // Splits a limit of the whole container across the shards
+        int shardLimit(int val) const { return qMax(1, val / static_cast<int>(m_shards.size())); }
+        qint64 shardLimit(qint64 val) const { return val <= 0 ? 0 : qMax(Q_INT64_C(1), val / static_cast<qint64>(m_shards.size())); }
+    public:
+        // If numShards is not positive twice the number of cores is used. The number of shards is rounded up to a power of 2
+        explicit ConcurrentHugeHash(int numShards = 0)
+        {
+            if (numShards <= 0)
+                numShards = 2 * qMax(1, QThread::idealThreadCount());
+            int shardCount = 1;
+            while (shardCount < numShards)
+                shardCount <<= 1;
+            m_shards.reserve(shardCount);
+            for (int i = 0; i < shardCount; ++i)
+                m_shards.push_back(std::make_unique<Shard>());
+        }
+        int shardCount() const { return static_cast<int>(m_shards.size()); }
+        bool contains(const KeyType& key) const
+        {
+            Shard& sh = shard(key);
+            QReadLocker locker(&sh.m_lock);
+            return sh.m_container.contains(key);
+        }
+        int size() const
+        {
+            int result = 0;
+            for (auto i = m_shards.cbegin(); i != m_shards.cend(); ++i) {
+                QReadLocker locker(&(*i)->m_lock);
+                result += (*i)->m_container.size();
+            }
+            return result;
+        }
+        int count() const { return size(); }
+        bool isEmpty() const { return size() == 0; }
+        QList<KeyType> keys() const
+        {
+            QList<KeyType> result;
+            for (auto i = m_shards.cbegin(); i != m_shards.cend(); ++i) {
+                QReadLocker locker(&(*i)->m_lock);
+                result.append((*i)->m_container.keys());
+            }
+            return result;
+        }
+        ValueType value(const KeyType& key, const ValueType& defaultValue = ValueType()) const
+        {
+            Shard& sh = shard(key);
+#ifdef Q_OS_UNIX
+            // If the block is moved while it's being read the read is retried, after that the value is read holding the write lock
+            for (int attempt = 0; attempt < 2; ++attempt) {
+                qint64 blockPos;
+                qint64 blockSize;
+                quint64 generation;
+                bool compressed;
+                QElapsedTimer decodeTimer;
+                QByteArray block;
+                {
+                    QReadLocker fileLocker(&sh.m_fileLock);
+                    int fileHandle;
+                    {
+                        QReadLocker locker(&sh.m_lock);
+                        const HugeHash<KeyType, ValueType>& cont = sh.m_container;
+                        const auto itemIter = cont.m_d->m_itemsMap->constFind(key);
+                        if (itemIter == cont.m_d->m_itemsMap->constEnd())
+                            return defaultValue;
+                        if (itemIter->isAvailable()) {
+                            recordHit(sh, key);
+                            return *(itemIter->val());
+                        }
+                        if (itemIter->isInline()) {
+                            auto result = cont.valueFromData(itemIter->inlineBlock());
+                            return result ? *result : defaultValue;
+                        }
+                        if (!cont.blockRange(key, blockPos, blockSize))
+                            break;
+                        generation = cont.m_d->m_fileGeneration;
+                        fileHandle = cont.m_d->m_device->handle();
+                        compressed = cont.m_d->m_compressionLevel != 0;
+                    }
+                    decodeTimer.start();
+                    block = ContainerData::readAt(fileHandle, blockPos, blockSize);
+                }
+                {
+                    // The block might have been overwritten while reading it, don't decode it in that case
+                    QReadLocker locker(&sh.m_lock);
+                    if (sh.m_container.m_d->m_fileGeneration != generation)
+                        continue;
+                }
+                if (compressed)
+                    block = qUncompress(block);
+                auto result = sh.m_container.valueFromData(block);
+                if (!result)
+                    break;
+                const double cacheWeight = static_cast<double>(qMax(Q_INT64_C(1), decodeTimer.nsecsElapsed())) / static_cast<double>(block.size());
+                const ValueType resultCopy(*result);
+                // Readers don't wait for each other to cache the value, it's left to the next writer if the shard is busy
+                if (!sh.m_lock.tryLockForWrite()) {
+                    recordValue(sh, ReadValue{ key, blockPos, block.size(), generation, cacheWeight, std::move(result) });
+                    return resultCopy;
+                }
+                replayHits(sh);
+                if (sh.m_container.m_d->m_fileGeneration == generation)
+                    sh.m_container.installValue(key, blockPos, result, block.size(), cacheWeight);
+                sh.m_lock.unlock();
+                return resultCopy;
+            }
+#endif
+            QWriteLocker locker(&sh.m_lock);
+            replayHits(sh);
+            return sh.m_container.value(key, defaultValue);
+        }
+        bool insert(const KeyType& key, const ValueType& val)
+        {
+            Shard& sh = shard(key);
+            QWriteLocker locker(&sh.m_lock);
+            replayHits(sh);
+            return sh.m_container.insert(key, val) != sh.m_container.end();
+        }
+        bool remove(const KeyType& key)
+        {
+            Shard& sh = shard(key);
+            QWriteLocker locker(&sh.m_lock);
+            replayHits(sh);
+            return sh.m_container.remove(key);
+        }
+        ValueType take(const KeyType& key)
+        {
+            Shard& sh = shard(key);
+            QWriteLocker locker(&sh.m_lock);
+            replayHits(sh);
+            return sh.m_container.take(key);
+        }
+        void clear()
+        {
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                (*i)->m_container.clear();
+            }
+        }
+        // Total number of keys expected, split evenly across the shards
+        void reserve(int size)
+        {
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                (*i)->m_container.reserve(shardLimit(size));
+            }
+        }
+        // Total number of values kept in memory, split evenly across the shards
+        bool setMaxCache(int val)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setMaxCache(shardLimit(val)) && result;
+            }
+            return result;
+        }
+        bool setMaxCacheBytes(qint64 val)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setMaxCacheBytes(shardLimit(val)) && result;
+            }
+            return result;
+        }
+        bool setMaxWriteQueueBytes(qint64 val)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setMaxWriteQueueBytes(shardLimit(val)) && result;
+            }
+            return result;
+        }
+        void setCachePolicy(CachePolicy val)
+        {
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                (*i)->m_container.setCachePolicy(val);
+            }
+        }
+        bool setCompressionLevel(int val)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker fileLocker(&(*i)->m_fileLock);
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setCompressionLevel(val) && result;
+            }
+            return result;
+        }
+        // Values still queued for writing are not waited for, that would change the shards
+        qint64 fileSize() const
+        {
+            qint64 result = 0;
+            for (auto i = m_shards.cbegin(); i != m_shards.cend(); ++i) {
+                QReadLocker locker(&(*i)->m_lock);
+                ContainerData& cont = *((*i)->m_container.m_d);
+                QMutexLocker fileLocker(&cont.m_fileMutex);
+                result += cont.m_memoryMap->lastKey();
+            }
+            return result;
+        }
+        qint64 diskUsage() const
+        {
+            qint64 result = 0;
+            for (auto i = m_shards.cbegin(); i != m_shards.cend(); ++i) {
+                QReadLocker locker(&(*i)->m_lock);
+                ContainerData& cont = *((*i)->m_container.m_d);
+                QMutexLocker fileLocker(&cont.m_fileMutex);
+                result += cont.diskUsage();
+            }
+            return result;
+        }
+        bool maintenanceFailed() const
+        {
+            for (auto i = m_shards.cbegin(); i != m_shards.cend(); ++i) {
+                QReadLocker locker(&(*i)->m_lock);
+                if ((*i)->m_container.maintenanceFailed())
+                    return true;
+            }
+            return false;
+        }
+        bool defrag()
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker fileLocker(&(*i)->m_fileLock);
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.defrag() && result;
+            }
+            return result;
+        }
+        // Each shard grows its own file by multiples of val
+        bool setGrowthChunk(qint64 val)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setGrowthChunk(val) && result;
+            }
+            return result;
+        }
+        bool setInlineSize(int val)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setInlineSize(val) && result;
+            }
+            return result;
+        }
+        // Each shard packs the values of its own file
+        bool setPageSize(qint64 val)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setPageSize(val) && result;
+            }
+            return result;
+        }
+        // Each shard keeps its own log, see HugeContainer::setLogStructured()
+        bool setLogStructured(qint64 segmentSize, double liveRatio = 0.5)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setLogStructured(segmentSize, liveRatio) && result;
+            }
+            return result;
+        }
+        qint64 collectGarbage()
+        {
+            qint64 result = 0;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                const qint64 moved = (*i)->m_container.collectGarbage();
+                if (moved < 0)
+                    return -1;
+                result += moved;
+            }
+            return result;
+        }
+        // Each shard compacts its own file, minFileSize is split evenly across the shards
+        bool setAutoCompaction(double highWatermark, double lowWatermark = 0.0, qint64 minFileSize = 0, qint64 stepBytes = 1 << 20)
+        {
+            bool result = true;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                result = (*i)->m_container.setAutoCompaction(highWatermark, lowWatermark, shardLimit(minFileSize), stepBytes) && result;
+            }
+            return result;
+        }
+        // Compacts each shard in turn, maxBytes is split evenly across the shards.
+        // Readers of a shard are only stopped while that shard moves its blocks
+        qint64 compact(qint64 maxBytes)
+        {
+            qint64 result = 0;
+            for (auto i = m_shards.begin(); i != m_shards.end(); ++i) {
+                QWriteLocker locker(&(*i)->m_lock);
+                replayHits(**i);
+                const qint64 moved = (*i)->m_container.compact(shardLimit(maxBytes));
+                if (moved < 0)
+                    return -1;
+                result += moved;
+            }
+            return result;
+        }
+    };
 }
 template<class KeyType, class ValueType, bool sorted>
 QDataStream& operator<<(QDataStream &out, const HugeContainers::HugeContainer<KeyType, ValueType, sorted>& cont){
@@ -952,14 +5170,13 @@ QDataStream& operator<<(QDataStream &out, const HugeContainers::HugeContainer<Ke
         }
         else{
             const QByteArray block = cont.readBlock(i.key());
-            if (sameVersion) {
+            // Raw blocks don't hold the QDataStream format
+            if (sameVersion && !HugeContainers::RawValueStorage<ValueType>::value) {
                 out.writeRawData(block.constData(), block.size());
             }
             else {
-                ValueType result;
-                QDataStream readerStream(block);
-                readerStream >> result;
-                out << result;
+                const auto result = cont.valueFromData(block);
+                out << (result ? *result : ValueType());
             }
         }
     }
@@ -2,6 +2,7 @@
 #include <QDebug>
 #include <QDataStream>
 #include <functional>
+#include <thread>
 #include "tst_hugemap.h"
 #define SINGLE_ARG(...) __VA_ARGS__ // to allow templates with multiple parameters inside macros
 using namespace HugeContainers;
@@ -41,6 +42,7 @@ public:
     friend QDebug operator<< (QDebug d, const ValueClass &c);
 };
 Q_DECLARE_METATYPE(ValueClass)
+Q_DECLARE_METATYPE(HugeContainers::CachePolicy)
 
 QDataStream& operator<<(QDataStream& steram, const ValueClass& target){
     return steram << target.m_str;
@@ -54,6 +56,59 @@ QDebug operator<< (QDebug d, const ValueClass &c)
     d << c.m_str;
     return d;
 }
+// Copies of negative values block while the gate is closed, they keep a reader inside the read lock of its shard
+class GatedValue
+{
+    int m_val;
+public:
+    static QAtomicInt s_closed;
+    static QSemaphore s_copying;
+    static QSemaphore s_gate;
+    int val() const { return m_val; }
+    GatedValue(int val = 0)
+        :m_val(val)
+    {}
+    GatedValue(const GatedValue& other)
+        :m_val(other.m_val)
+    {
+        if (m_val < 0 && s_closed.load()) {
+            s_copying.release();
+            s_gate.tryAcquire(1, 10000);
+        }
+    }
+    GatedValue& operator=(const GatedValue&) = default;
+    bool operator==(const GatedValue& other) const { return m_val == other.m_val; }
+};
+QAtomicInt GatedValue::s_closed(0);
+QSemaphore GatedValue::s_copying;
+QSemaphore GatedValue::s_gate;
+QDataStream& operator<<(QDataStream& stream, const GatedValue& target){
+    return stream << static_cast<qint32>(target.val());
+}
+QDataStream& operator>>(QDataStream& stream, GatedValue& target){
+    qint32 val;
+    stream >> val;
+    target = GatedValue(val);
+    return stream;
+}
+// Trivially copyable value stored as its bytes, they are more than the QDataStream format holds
+struct RawPoint
+{
+    qint8 m_tag;
+    double m_pos;
+    bool operator==(const RawPoint& other) const { return m_tag == other.m_tag && m_pos == other.m_pos; }
+};
+namespace HugeContainers {
+    template <>
+    struct RawValueStorage<RawPoint> : std::true_type {};
+}
+QDataStream& operator<<(QDataStream& stream, const RawPoint& target){
+    return stream << target.m_tag << target.m_pos;
+}
+QDataStream& operator>>(QDataStream& stream, RawPoint& target){
+    return stream >> target.m_tag >> target.m_pos;
+}
+
 namespace QTest {
     char *toString(const KeyClass &key) 
     {
@@ -178,6 +233,7 @@ void tst_HugeMap::testMinimalFileSize_data()
     container.setMaxCache(1);
     container.insert(0, ValueClass()); // 0 items in file 
     container.insert(1, ValueClass());
+    const qint64 size0 = container.fileSize();
     container.insert(2, ValueClass());
     const qint64 size1 = container.fileSize();
     container.insert(3, ValueClass());
@@ -186,7 +242,7 @@ void tst_HugeMap::testMinimalFileSize_data()
     container.remove(2);
     QTest::newRow("Remove last 2 items") << container << size1;
     container.remove(1);
-    QTest::newRow("Remove all but 1 item") << container << static_cast<qint64>(0);
+    QTest::newRow("Remove all but 1 item") << container << size0;
 }
 
 void tst_HugeMap::testContains()
@@ -381,8 +437,7 @@ void tst_HugeMap::testDefrag_data()
     container.insert(8, 'E');
     container.insert(16, 'F');
     QTest::newRow("No Frag") << container << qint64(5);
-    const auto junk = container.value(0);
-    Q_UNUSED(junk);
+    container[0] = 'A';
     QTest::newRow("1 Hole") << container << qint64(5);
     container.remove(8);
     QTest::newRow("2 Separate Holes") << container << qint64(4);
@@ -417,13 +472,13 @@ void tst_HugeMap::testFragmentation()
     QCOMPARE(container.fragmentation(), 0.0);
     const auto junk = container.value(0);
     Q_UNUSED(junk);
-    QCOMPARE(container.fragmentation(), 0.2);
+    QCOMPARE(container.fragmentation(), 0.0);
     container.remove(8);
-    QCOMPARE(container.fragmentation(), 0.25);
+    QCOMPARE(container.fragmentation(), 0.0);
     container.remove(2);
-    QCOMPARE(container.fragmentation(), 0.5);
+    QCOMPARE(container.fragmentation(), 0.25);
     container.remove(4);
-    QCOMPARE(container.fragmentation(), 0.5);
+    QCOMPARE(container.fragmentation(), 0.0);
     container.insert(9, 'F');
     QCOMPARE(container.fragmentation(), 0.0);
     container.clear();
@@ -517,6 +572,689 @@ void tst_HugeMap::testCacheSizeChange()
     QCOMPARE(container2, baseContainer);
 }
 
+void tst_HugeMap::testCachePolicy_data()
+{
+    QTest::addColumn<CachePolicy>("policy");
+    QTest::newRow("LRU") << CachePolicy::LRU;
+    QTest::newRow("Clock") << CachePolicy::Clock;
+    QTest::newRow("LFU") << CachePolicy::LFU;
+    QTest::newRow("ARC") << CachePolicy::ARC;
+    QTest::newRow("2Q") << CachePolicy::TwoQueue;
+    QTest::newRow("GDSF") << CachePolicy::GDSF;
+}
+
+void tst_HugeMap::testCachePolicy()
+{
+    QFETCH(const CachePolicy, policy);
+    HugeMap<KeyClass, ValueClass> container;
+    QCOMPARE(container.cachePolicy(), CachePolicy::LRU);
+    container.setCachePolicy(policy);
+    QCOMPARE(container.cachePolicy(), policy);
+    container.setMaxCache(4);
+    for (int i = 0; i < 20; ++i)
+        container.insert(i, QString::number(i));
+    // Skewed access pattern: low keys are read much more often
+    for (int i = 0; i < 200; ++i) {
+        const int key = (i % 3 == 0) ? (i % 20) : (i % 3);
+        QCOMPARE(container.value(key), ValueClass(QString::number(key)));
+    }
+    const auto container2 = container;
+    container[KeyClass(1)] = ValueClass(QStringLiteral("one"));
+    QVERIFY(container.remove(KeyClass(2)));
+    QCOMPARE(container2.value(KeyClass(1)), ValueClass(QStringLiteral("1")));
+    QCOMPARE(container2.value(KeyClass(2)), ValueClass(QStringLiteral("2")));
+    QCOMPARE(container.value(KeyClass(1)), ValueClass(QStringLiteral("one")));
+    container.setCachePolicy(CachePolicy::LRU);
+    QCOMPARE(container.cachePolicy(), CachePolicy::LRU);
+    QCOMPARE(container2.cachePolicy(), policy);
+    for (int i = 3; i < 20; ++i)
+        QCOMPARE(container.value(i), ValueClass(QString::number(i)));
+    // Values evicted to the ghost queues of the policy are overwritten by unite()
+    container.setCachePolicy(policy);
+    HugeMap<KeyClass, ValueClass> otherContainer;
+    otherContainer.setMaxCache(1);
+    for (int i = 3; i < 20; ++i)
+        otherContainer.insert(i, QString::number(-i));
+    QVERIFY(container.unite(otherContainer, true));
+    for (int j = 0; j < 3; ++j) {
+        for (int i = 3; i < 20; ++i)
+            QCOMPARE(container.value(i), ValueClass(QString::number(-i)));
+    }
+}
+
+void tst_HugeMap::testCacheBytes()
+{
+    HugeMap<int, QByteArray> container;
+    container.setMaxCache(1000);
+    QCOMPARE(container.maxCacheBytes(), qint64(0));
+    QVERIFY(container.setMaxCacheBytes(10000));
+    QCOMPARE(container.maxCacheBytes(), qint64(10000));
+    const QByteArray data(2000, 'A');
+    const qint64 serialisedSize = 2004; // size prefix + data
+    for (int i = 0; i < 10; ++i)
+        container.insert(i, data);
+    QCOMPARE(container.cacheBytes(), 4 * serialisedSize);
+    QCOMPARE(container.fileSize(), 6 * serialisedSize);
+    QVERIFY(container.setMaxCacheBytes(5000));
+    QCOMPARE(container.cacheBytes(), 2 * serialisedSize);
+    QCOMPARE(container.fileSize(), 8 * serialisedSize);
+    QVERIFY(container.setValueSizeFunction([](const QByteArray& val) -> qint64 {return val.size() / 2; }));
+    QCOMPARE(container.cacheBytes(), qint64(2000));
+    for (int i = 0; i < 10; ++i)
+        QCOMPARE(container.value(i), data);
+    QCOMPARE(container.cacheBytes(), qint64(5000));
+    const auto container2 = container;
+    QVERIFY(container.setMaxCacheBytes(0));
+    QCOMPARE(container.cacheBytes(), qint64(0));
+    QCOMPARE(container2.cacheBytes(), qint64(5000));
+    QCOMPARE(container, container2);
+    // Values changed through references are measured again
+    HugeMap<int, QByteArray> container3;
+    QVERIFY(container3.setMaxCacheBytes(10000));
+    container3.insert(0, QByteArray());
+    QCOMPARE(container3.cacheBytes(), qint64(4));
+    container3[0].append(data);
+    QCOMPARE(container3.cacheBytes(), serialisedSize);
+    for (int i = 1; i < 4; ++i) {
+        container3.insert(i, QByteArray());
+        container3.begin().value().append(data);
+    }
+    QCOMPARE(container3.cacheBytes(), 4 * data.size() + 4 * qint64(4));
+    // Going over the limit evicts values on the next insertion
+    container3[0].append(data);
+    container3.insert(4, QByteArray());
+    QVERIFY(container3.cacheBytes() <= 10000);
+    QCOMPARE(container3.value(0), QByteArray(5 * data.size(), 'A'));
+}
+
+void tst_HugeMap::testCleanEviction()
+{
+    HugeMap<KeyClass, qint8> container;
+    container.setMaxCache(2);
+    for (int i = 0; i < 10; ++i)
+        container.insert(i, qint8('A' + i));
+    QCOMPARE(container.fileSize(), qint64(8));
+    for (int i = 0; i < 10; ++i)
+        QCOMPARE(container.value(i), qint8('A' + i));
+    // Values read from the file keep their copy there
+    QCOMPARE(container.fileSize(), qint64(10));
+    for (int i = 9; i >= 0; --i)
+        QCOMPARE(container.value(i), qint8('A' + i));
+    QCOMPARE(container.fileSize(), qint64(10));
+    QCOMPARE(container.fragmentation(), 0.0);
+    container[0] = 'Z';
+    // The block of the modified value is kept to write it back in place
+    QCOMPARE(container.fragmentation(), 0.0);
+    QCOMPARE(container.fileSize(), qint64(10));
+    for (int i = 2; i < 10; ++i)
+        QCOMPARE(container.value(i), qint8('A' + i));
+    QCOMPARE(container.value(0), qint8('Z'));
+    QVERIFY(container.defrag());
+    for (int i = 1; i < 10; ++i)
+        QCOMPARE(container.value(i), qint8('A' + i));
+    QCOMPARE(container.value(0), qint8('Z'));
+    QCOMPARE(container.fileSize(), qint64(10));
+}
+
+void tst_HugeMap::testWriteBehind()
+{
+    HugeMap<int, QByteArray> container;
+    QCOMPARE(container.maxWriteQueueBytes(), qint64(0));
+    QVERIFY(container.setMaxWriteQueueBytes(1000));
+    QCOMPARE(container.maxWriteQueueBytes(), qint64(1000));
+    const qint64 serialisedSize = 104; // size prefix + data
+    for (int i = 0; i < 10; ++i)
+        container.insert(i, QByteArray(100, 'A' + i));
+    QCOMPARE(container.fileSize(), 9 * serialisedSize);
+    for (int i = 9; i >= 0; --i)
+        QCOMPARE(container.value(i), QByteArray(100, 'A' + i));
+    const auto container2 = container;
+    for (int i = 0; i < 10; ++i)
+        container[i].append('Z');
+    for (int i = 0; i < 10; ++i) {
+        QCOMPARE(container.value(i), QByteArray(100, 'A' + i) + 'Z');
+        QCOMPARE(container2.value(i), QByteArray(100, 'A' + i));
+    }
+    QVERIFY(container.remove(5));
+    QVERIFY(container.setMaxWriteQueueBytes(0));
+    QCOMPARE(container.maxWriteQueueBytes(), qint64(0));
+    QCOMPARE(container.size(), 9);
+    for (int i = 0; i < 10; ++i) {
+        if (i != 5)
+            QCOMPARE(container.value(i), QByteArray(100, 'A' + i) + 'Z');
+    }
+}
+
+void tst_HugeMap::testReadAhead()
+{
+    HugeMap<KeyClass, ValueClass> container;
+    QCOMPARE(container.readAhead(), 32);
+    QVERIFY(container.setReadAhead(10));
+    QCOMPARE(container.readAhead(), 10);
+    // Values read ahead share the cache limit
+    container.setMaxCache(20);
+    for (int i = 0; i < 100; ++i)
+        container.insert(i, ValueClass(QString::number(i)));
+    for (auto i = container.constBegin(); i != container.constEnd(); ++i)
+        QCOMPARE(i.value(), ValueClass(QString::number(i.key().val())));
+    const qint64 fileSize = container.fileSize();
+    for (auto i = container.constEnd() - 1; i != container.constBegin(); --i)
+        QCOMPARE(i.value(), ValueClass(QString::number(i.key().val())));
+    QCOMPARE(container.fileSize(), fileSize);
+    for (auto i = container.begin(); i != container.end(); ++i) {
+        if (i.key().val() % 2 == 0)
+            i.value() = ValueClass(QStringLiteral("even"));
+    }
+    for (auto i = container.constBegin(); i != container.constEnd(); ++i)
+        QCOMPARE(i.value(), i.key().val() % 2 == 0 ? ValueClass(QStringLiteral("even")) : ValueClass(QString::number(i.key().val())));
+    QVERIFY(container.setReadAhead(0));
+    QCOMPARE(container.readAhead(), 0);
+    for (auto i = container.constEnd() - 1; i != container.constBegin(); --i)
+        QCOMPARE(i.value(), i.key().val() % 2 == 0 ? ValueClass(QStringLiteral("even")) : ValueClass(QString::number(i.key().val())));
+}
+
+void tst_HugeMap::testMemoryMapped()
+{
+    HugeMap<KeyClass, ValueClass> container;
+    QVERIFY(!container.isMemoryMapped());
+    QVERIFY(container.setMemoryMapped(true));
+    QVERIFY(container.isMemoryMapped());
+    for (int i = 0; i < 50; ++i)
+        container.insert(i, ValueClass(QString::number(i)));
+    for (int i = 0; i < 50; ++i)
+        QCOMPARE(container.value(i), ValueClass(QString::number(i)));
+    // Grow the file after it was mapped
+    for (int i = 50; i < 100; ++i)
+        container.insert(i, ValueClass(QString::number(i)));
+    for (int i = 99; i >= 0; --i)
+        QCOMPARE(container.value(i), ValueClass(QString::number(i)));
+    for (int i = 0; i < 100; i += 2)
+        container.remove(i);
+    QVERIFY(container.setCompressionLevel(5));
+    for (int i = 1; i < 100; i += 2)
+        QCOMPARE(container.value(i), ValueClass(QString::number(i)));
+    const auto container2 = container;
+    QVERIFY(container2.isMemoryMapped());
+    QVERIFY(container.setMemoryMapped(false));
+    QVERIFY(!container.isMemoryMapped());
+    QCOMPARE(container, container2);
+}
+
+void tst_HugeMap::testCopyLargeFile()
+{
+    HugeMap<int, QByteArray> container;
+    for (int i = 0; i < 100; ++i)
+        container.insert(i, QByteArray(2000, 'A' + i % 26));
+    QVERIFY(container.fileSize() > 3 * (1 << 16));
+    auto container2 = container;
+    container2[0] = QByteArray("changed");
+    QCOMPARE(container.value(0), QByteArray(2000, 'A'));
+    QCOMPARE(container2.value(0), QByteArray("changed"));
+    for (int i = 99; i > 0; --i)
+        QCOMPARE(container2.value(i), QByteArray(2000, 'A' + i % 26));
+}
+
+void tst_HugeMap::testConcurrentHash()
+{
+    ConcurrentHugeHash<int, QByteArray> container(4);
+    QCOMPARE(container.shardCount(), 4);
+    QVERIFY(container.setMaxCache(8));
+    for (int i = 0; i < 200; ++i)
+        QVERIFY(container.insert(i, QByteArray(100, 'A' + i % 26)));
+    QAtomicInt mismatches(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; ++t) {
+        workers.emplace_back([&container, &mismatches, t]() {
+            for (int i = 0; i < 2000; ++i) {
+                const int key = (i * 7 + t * 13) % 200;
+                if (t == 0 && i % 5 == 0)
+                    container.insert(key, QByteArray(100, 'A' + key % 26));
+                else if (t == 1 && i % 500 == 0)
+                    container.defrag();
+                else if (container.value(key) != QByteArray(100, 'A' + key % 26))
+                    mismatches.ref();
+            }
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+    QCOMPARE(mismatches.load(), 0);
+    QCOMPARE(container.size(), 200);
+    QCOMPARE(container.value(500, QByteArray("default")), QByteArray("default"));
+    QCOMPARE(container.take(0), QByteArray(100, 'A'));
+    QVERIFY(!container.contains(0));
+    QVERIFY(container.remove(1));
+    QCOMPARE(container.keys().size(), 198);
+    container.clear();
+    QVERIFY(container.isEmpty());
+}
+
+void tst_HugeMap::testConcurrentMisses()
+{
+    // A value read from the file is returned without waiting for the other readers of the shard
+    ConcurrentHugeHash<int, GatedValue> container(1);
+    QVERIFY(container.setMaxCache(1));
+    QVERIFY(container.insert(2, GatedValue(2)));
+    QVERIFY(container.insert(1, GatedValue(-1)));
+    GatedValue::s_closed.store(1);
+    std::thread reader([&container]() { container.value(1); });
+    const bool readerInside = GatedValue::s_copying.tryAcquire(1, 10000);
+    QElapsedTimer missTimer;
+    missTimer.start();
+    const GatedValue missedValue = container.value(2);
+    const qint64 missTime = missTimer.elapsed();
+    GatedValue::s_closed.store(0);
+    GatedValue::s_gate.release();
+    reader.join();
+    QVERIFY(readerInside);
+    QVERIFY(missedValue == GatedValue(2));
+    QVERIFY(missTime < 5000);
+    QVERIFY(container.value(1) == GatedValue(-1));
+    QVERIFY(container.value(2) == GatedValue(2));
+    QVERIFY(container.fileSize() > 0);
+}
+
+void tst_HugeMap::testInsertBatch()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(10));
+    container.insert(5, QByteArray("old"));
+    QVector<QPair<int, QByteArray> > items;
+    for (int i = 0; i < 100; ++i)
+        items.append(qMakePair(i, QByteArray(100, 'A' + i % 26)));
+    items.append(qMakePair(7, QByteArray("last")));
+    QVERIFY(container.insertBatch(items));
+    QCOMPARE(container.size(), 100);
+    QCOMPARE(container.value(5), QByteArray(100, 'F'));
+    QCOMPARE(container.value(7), QByteArray("last"));
+    for (int i = 99; i >= 0; --i) {
+        if (i != 7)
+            QCOMPARE(container.value(i), QByteArray(100, 'A' + i % 26));
+    }
+    const std::map<int, QByteArray> stdItems{ { 3, QByteArray("three") }, { 200, QByteArray("new") } };
+    QVERIFY(container.insert(stdItems.cbegin(), stdItems.cend()));
+    QCOMPARE(container.size(), 101);
+    QCOMPARE(container.value(3), QByteArray("three"));
+    QCOMPARE(container.value(200), QByteArray("new"));
+    QVERIFY(container.insertBatch(QVector<QPair<int, QByteArray> >()));
+    QCOMPARE(container.size(), 101);
+}
+
+void tst_HugeMap::testMultiGet()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(5));
+    for (int i = 0; i < 100; ++i)
+        container.insert(i, QByteArray(100, 'A' + i % 26));
+    const QList<int> keys{ 90, 3, 150, 42, 3, 99, 0 };
+    const QList<QByteArray> expected{ QByteArray(100, 'A' + 90 % 26), QByteArray(100, 'D'), QByteArray(), QByteArray(100, 'A' + 42 % 26), QByteArray(100, 'D'), QByteArray(100, 'A' + 99 % 26), QByteArray(100, 'A') };
+    QCOMPARE(container.values(keys), expected);
+    QCOMPARE(container.values(keys, QThreadPool::globalInstance()), expected);
+    QVERIFY(container.values(QList<int>()).isEmpty());
+}
+
+void tst_HugeMap::testBestFit()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(1));
+    container.insert(0, QByteArray(200, 'A'));
+    container.insert(1, QByteArray(10, 'B'));
+    container.insert(2, QByteArray(100, 'C'));
+    container.insert(3, QByteArray(10, 'D'));
+    container.insert(4, QByteArray(100, 'E'));
+    const qint64 fileSize = container.fileSize();
+    container.remove(0);
+    container.remove(2);
+    // Each evicted value fills the hole of its exact size
+    container.insert(5, QByteArray(200, 'F'));
+    container.insert(6, QByteArray(1, 'G'));
+    QCOMPARE(container.fileSize(), fileSize);
+    QCOMPARE(container.fragmentation(), 0.0);
+    QCOMPARE(container.value(4), QByteArray(100, 'E'));
+    QCOMPARE(container.value(5), QByteArray(200, 'F'));
+}
+
+void tst_HugeMap::testSlotHeadroom()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(1));
+    QVERIFY(container.setSlotHeadroom(0.5));
+    container.insert(0, QByteArray(100, 'A'));
+    container.insert(1, QByteArray(100, 'B'));
+    container.insert(2, QByteArray(100, 'C'));
+    QCOMPARE(container.value(1), QByteArray(100, 'B'));
+    const qint64 fileSize = container.fileSize();
+    // The value grows within the headroom of its block and is rewritten in place
+    for (int i = 0; i < 5; ++i) {
+        container[0].append(QByteArray(10, 'x'));
+        QCOMPARE(container.value(1), QByteArray(100, 'B'));
+        QCOMPARE(container.fileSize(), fileSize);
+        QCOMPARE(container.fragmentation(), 0.0);
+    }
+    // Outgrowing the block moves the value and leaves a hole
+    container[0].append(QByteArray(20, 'y'));
+    QCOMPARE(container.value(1), QByteArray(100, 'B'));
+    QVERIFY(container.fragmentation() > 0.0);
+    QCOMPARE(container.value(0), QByteArray(100, 'A') + QByteArray(50, 'x') + QByteArray(20, 'y'));
+    QVERIFY(container.defrag());
+    QCOMPARE(container.value(0).size(), 170);
+    QCOMPARE(container.value(2), QByteArray(100, 'C'));
+}
+
+void tst_HugeMap::testCompact()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(1));
+    for (int i = 0; i < 10; ++i)
+        container.insert(i, QByteArray(100, 'A' + i));
+    // The last value is still in the cache
+    const qint64 blockSize = container.fileSize() / 9;
+    for (int i = 0; i < 8; i += 2)
+        container.remove(i);
+    QVERIFY(container.fragmentation() > 0.0);
+    // Each call moves a single block from the end of the file into a hole
+    qint64 fileSize = container.fileSize();
+    for (qint64 moved = container.compact(1); moved != 0; moved = container.compact(1)) {
+        QCOMPARE(moved, blockSize);
+        QVERIFY(container.fileSize() < fileSize);
+        fileSize = container.fileSize();
+    }
+    QCOMPARE(container.fragmentation(), 0.0);
+    QCOMPARE(container.fileSize(), 5 * blockSize);
+    for (int i = 1; i < 10; ++i) {
+        if (i < 8 && i % 2 == 0)
+            QVERIFY(!container.contains(i));
+        else
+            QCOMPARE(container.value(i), QByteArray(100, 'A' + i));
+    }
+}
+
+void tst_HugeMap::testAutoCompaction()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(1));
+    QVERIFY(!container.setAutoCompaction(0.2, 0.5));
+    QVERIFY(container.setAutoCompaction(0.2, 0.05));
+    for (int i = 0; i < 20; ++i)
+        container.insert(i, QByteArray(100, 'A' + i));
+    // Once the holes reach the high watermark the file is compacted down to the low one
+    for (int i = 0; i < 20; i += 2) {
+        QVERIFY(container.remove(i));
+        QVERIFY(!container.maintenanceFailed());
+        QVERIFY(container.fragmentation() < 0.2);
+    }
+    for (int i = 1; i < 20; i += 2)
+        QCOMPARE(container.value(i), QByteArray(100, 'A' + i));
+    // Small files are left alone
+    HugeMap<int, QByteArray> smallContainer;
+    QVERIFY(smallContainer.setMaxCache(1));
+    QVERIFY(smallContainer.setAutoCompaction(0.2, 0.05, 1 << 20));
+    for (int i = 0; i < 20; ++i)
+        smallContainer.insert(i, QByteArray(100, 'A' + i));
+    for (int i = 0; i < 20; i += 2)
+        smallContainer.remove(i);
+    QVERIFY(smallContainer.fragmentation() > 0.2);
+    // Values queued for writing are not waited for and their blocks are not moved
+    HugeMap<int, QByteArray> queuedContainer;
+    QVERIFY(queuedContainer.setMaxCache(1));
+    QVERIFY(queuedContainer.setMaxWriteQueueBytes(1000));
+    QVERIFY(queuedContainer.setAutoCompaction(0.2, 0.05, 0, 200));
+    for (int i = 0; i < 40; ++i)
+        queuedContainer.insert(i, QByteArray(100, 'A' + i % 26));
+    for (int i = 0; i < 40; i += 2)
+        queuedContainer.remove(i);
+    for (int i = 1; i < 40; i += 2)
+        QCOMPARE(queuedContainer.value(i), QByteArray(100, 'A' + i % 26));
+    while (queuedContainer.compact(1 << 20) > 0) {}
+    QCOMPARE(queuedContainer.fragmentation(), 0.0);
+}
+
+void tst_HugeMap::testPunchHole()
+{
+#ifndef Q_OS_LINUX
+    QSKIP("Hole punching is only supported on Linux");
+#endif
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(1));
+    container.insert(0, QByteArray(1 << 20, 'A'));
+    container.insert(1, QByteArray(1 << 20, 'B'));
+    container.insert(2, QByteArray(1 << 20, 'C'));
+    container.insert(3, QByteArray(1, 'D'));
+    const qint64 fileSize = container.fileSize();
+    const qint64 diskUsage = container.diskUsage();
+    // The space of the value in the middle of the file goes back to the filesystem without changing the layout
+    container.remove(1);
+    QCOMPARE(container.fileSize(), fileSize);
+    const qint64 punchedUsage = container.diskUsage();
+    QCOMPARE(container.value(0), QByteArray(1 << 20, 'A'));
+    QCOMPARE(container.value(2), QByteArray(1 << 20, 'C'));
+    // The released space is allocated again when it's reused
+    container.insert(4, QByteArray(1, 'E'));
+    QCOMPARE(container.fileSize(), fileSize);
+    QCOMPARE(container.value(3), QByteArray(1, 'D'));
+    QCOMPARE(container.value(4), QByteArray(1, 'E'));
+    if (punchedUsage > diskUsage - (1 << 19))
+        QSKIP("The filesystem of the temporary directory doesn't support punching holes");
+}
+
+void tst_HugeMap::testGrowthChunk()
+{
+    HugeMap<int, QByteArray> container;
+    HugeMap<int, QByteArray> reference;
+    QVERIFY(container.setMaxCache(1));
+    QVERIFY(reference.setMaxCache(1));
+    QVERIFY(container.setGrowthChunk(1 << 16));
+    QCOMPARE(container.growthChunk(), Q_INT64_C(1) << 16);
+    for (int i = 0; i < 10; ++i) {
+        container.insert(i, QByteArray(100, 'A' + i));
+        reference.insert(i, QByteArray(100, 'A' + i));
+    }
+    // The space allocated in advance is not part of the size of the file
+    QCOMPARE(container.fileSize(), reference.fileSize());
+#ifdef Q_OS_LINUX
+    QVERIFY(container.diskUsage() >= 1 << 16);
+#endif
+    container.remove(9);
+    container.remove(8);
+    reference.remove(9);
+    reference.remove(8);
+    QCOMPARE(container.fileSize(), reference.fileSize());
+    for (int i = 0; i < 8; ++i)
+        QCOMPARE(container.value(i), QByteArray(100, 'A' + i));
+}
+
+void tst_HugeMap::testLogStructured()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(1));
+    QVERIFY(!container.setLogStructured(1 << 12, 1.0));
+    QVERIFY(container.setLogStructured(1 << 12, 0.5));
+    QCOMPARE(container.segmentSize(), Q_INT64_C(1) << 12);
+    // Every version is appended to the log, dead versions are collected so the file doesn't keep growing
+    qint64 maxFileSize = 0;
+    for (int round = 0; round < 50; ++round) {
+        for (int i = 0; i < 20; ++i)
+            container.insert(i, QByteArray(100, 'A' + (i + round) % 26));
+        maxFileSize = qMax(maxFileSize, container.fileSize());
+    }
+    QVERIFY(maxFileSize <= 4 * (1 << 12));
+    for (int i = 0; i < 20; ++i)
+        QCOMPARE(container.value(i), QByteArray(100, 'A' + (i + 49) % 26));
+    for (int i = 0; i < 20; i += 2)
+        container.remove(i);
+    QVERIFY(container.defrag());
+    for (int i = 1; i < 20; i += 2)
+        QCOMPARE(container.value(i), QByteArray(100, 'A' + (i + 49) % 26));
+    // Values take 104 bytes in the file. A quarter of them is left in each segment of 2048 bytes
+    HugeMap<int, QByteArray> sparseContainer;
+    QVERIFY(sparseContainer.setMaxCache(1));
+    for (int i = 0; i < 80; ++i)
+        sparseContainer.insert(i, QByteArray(100, 'a' + i % 26));
+    for (int i = 0; i < 80; ++i) {
+        if (i % 4 != 0)
+            sparseContainer.remove(i);
+    }
+    QVERIFY(sparseContainer.setLogStructured(1 << 11, 0.5));
+    // The blocks of the first 60 values fill the first three segments, the file ends in the fourth one where the log continues
+    QCOMPARE(sparseContainer.collectGarbage(), Q_INT64_C(15 * 104));
+    // The collected segments are free as a whole, a value as large as them is written there without growing the file
+    const qint64 fileSize = sparseContainer.fileSize();
+    sparseContainer.insert(100, QByteArray(6000, 'z'));
+    sparseContainer.insert(101, QByteArray(1, 'y'));
+    QCOMPARE(sparseContainer.fileSize(), fileSize);
+    for (int i = 0; i < 80; i += 4)
+        QCOMPARE(sparseContainer.value(i), QByteArray(100, 'a' + i % 26));
+    QCOMPARE(sparseContainer.value(100), QByteArray(6000, 'z'));
+    QCOMPARE(sparseContainer.value(101), QByteArray(1, 'y'));
+}
+
+void tst_HugeMap::testTrivialValues()
+{
+    HugeMap<int, double> container;
+    QVERIFY(container.setMaxCache(1));
+    for (int i = 0; i < 100; ++i)
+        container.insert(i, i * 0.5);
+    for (int i = 0; i < 100; ++i)
+        QCOMPARE(container.value(i), i * 0.5);
+    // Every block has the same size so a rewrite always fits in a freed one
+    const qint64 fileSize = container.fileSize();
+    for (int round = 0; round < 5; ++round) {
+        for (int i = 0; i < 100; i += 3)
+            container.remove(i);
+        for (int i = 0; i < 100; i += 3)
+            container.insert(i, i * 0.25 + round);
+    }
+    QVERIFY(container.fileSize() <= fileSize);
+    for (int i = 0; i < 100; ++i)
+        QCOMPARE(container.value(i), i % 3 == 0 ? i * 0.25 + 4 : i * 0.5);
+    QByteArray serialised;
+    {
+        QDataStream writeStream(&serialised, QIODevice::WriteOnly);
+        writeStream << container;
+    }
+    HugeMap<int, double> container2;
+    QDataStream readStream(serialised);
+    readStream >> container2;
+    QCOMPARE(container2.size(), 100);
+    for (int i = 0; i < 100; ++i)
+        QCOMPARE(container2.value(i), container.value(i));
+    // Values are only stored raw when their type opts in
+    HugeMap<int, RawPoint> rawContainer;
+    QVERIFY(rawContainer.setMaxCache(1));
+    for (int i = 0; i < 100; ++i)
+        rawContainer.insert(i, RawPoint{ static_cast<qint8>(i), i * 0.5 });
+    for (int i = 0; i < 100; i += 3)
+        rawContainer.remove(i);
+    for (int i = 0; i < 100; i += 3)
+        rawContainer.insert(i, RawPoint{ static_cast<qint8>(-i), i * 0.25 });
+    for (int i = 0; i < 100; ++i)
+        QVERIFY(rawContainer.value(i) == (i % 3 == 0 ? RawPoint{ static_cast<qint8>(-i), i * 0.25 } : RawPoint{ static_cast<qint8>(i), i * 0.5 }));
+    serialised.clear();
+    {
+        QDataStream writeStream(&serialised, QIODevice::WriteOnly);
+        writeStream << rawContainer;
+    }
+    HugeMap<int, RawPoint> rawContainer2;
+    QDataStream rawStream(serialised);
+    rawStream >> rawContainer2;
+    QCOMPARE(rawContainer2.size(), 100);
+    for (int i = 0; i < 100; ++i)
+        QVERIFY(rawContainer2.value(i) == rawContainer.value(i));
+}
+
+void tst_HugeMap::testPagePacking()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(1));
+    QVERIFY(!container.setPageSize(-1));
+    QVERIFY(container.setPageSize(1 << 12));
+    QCOMPARE(container.pageSize(), Q_INT64_C(1) << 12);
+    for (int i = 0; i < 200; ++i)
+        container.insert(i, QByteArray(50, 'A' + i % 26));
+    // 75 blocks of 54 bytes fit in a page
+    QCOMPARE(container.fileSize(), Q_INT64_C(3) << 12);
+    for (int i = 0; i < 200; i += 2)
+        container.insert(i, QByteArray(20 + i % 30, 'a' + i % 26));
+    for (int i = 0; i < 200; ++i)
+        QCOMPARE(container.value(i), i % 2 == 0 ? QByteArray(20 + i % 30, 'a' + i % 26) : QByteArray(50, 'A' + i % 26));
+    QVERIFY(container.defrag());
+    QVERIFY(container.compact(1 << 20) >= 0);
+    QVector<QPair<int, QByteArray> > batch;
+    for (int i = 200; i < 300; ++i)
+        batch.append(qMakePair(i, QByteArray(10, 'A' + i % 26)));
+    QVERIFY(container.insertBatch(batch));
+    for (int i = 0; i < 300; ++i)
+        QCOMPARE(container.value(i), i >= 200 ? QByteArray(10, 'A' + i % 26) : i % 2 == 0 ? QByteArray(20 + i % 30, 'a' + i % 26) : QByteArray(50, 'A' + i % 26));
+    // A page is freed with its last value
+    for (int i = 0; i < 300; ++i)
+        container.remove(i);
+    QCOMPARE(container.fileSize(), Q_INT64_C(0));
+    // A page is moved with all its values even if it's larger than a compaction step
+    HugeMap<int, QByteArray> pagedContainer;
+    QVERIFY(pagedContainer.setMaxCache(1));
+    QVERIFY(pagedContainer.setPageSize(1 << 12));
+    for (int i = 0; i < 4; ++i)
+        pagedContainer.insert(1000 + i, QByteArray(5000, 'a' + i));
+    for (int i = 0; i < 70; ++i)
+        pagedContainer.insert(i, QByteArray(50, 'A' + i % 26));
+    pagedContainer.remove(1000);
+    pagedContainer.remove(1002);
+    QCOMPARE(pagedContainer.compact(100), Q_INT64_C(1) << 12);
+    while (pagedContainer.compact(100) > 0) {}
+    for (int i = 0; i < 70; ++i)
+        QCOMPARE(pagedContainer.value(i), QByteArray(50, 'A' + i % 26));
+    QCOMPARE(pagedContainer.value(1001), QByteArray(5000, 'b'));
+    QCOMPARE(pagedContainer.value(1003), QByteArray(5000, 'd'));
+}
+
+void tst_HugeMap::testInlineValues()
+{
+    HugeMap<int, QByteArray> container;
+    QVERIFY(container.setMaxCache(1));
+    QVERIFY(!container.setInlineSize(-1));
+    QVERIFY(container.setInlineSize(16));
+    QCOMPARE(container.inlineSize(), 16);
+    for (int i = 0; i < 100; ++i)
+        container.insert(i, QByteArray(i % 2 == 0 ? 4 : 100, 'A' + i % 26));
+    // Only the big values are written, the last one is still in the cache
+    QCOMPARE(container.fileSize(), Q_INT64_C(49) * 104);
+    for (int i = 0; i < 100; ++i)
+        QCOMPARE(container.value(i), QByteArray(i % 2 == 0 ? 4 : 100, 'A' + i % 26));
+    for (int i = 0; i < 100; ++i)
+        container[i] = QByteArray(i % 2 == 0 ? 100 : 4, 'a' + i % 26);
+    for (int i = 0; i < 100; ++i)
+        QCOMPARE(container.value(i), QByteArray(i % 2 == 0 ? 100 : 4, 'a' + i % 26));
+    QByteArray serialised;
+    {
+        QDataStream writeStream(&serialised, QIODevice::WriteOnly);
+        writeStream << container;
+    }
+    HugeMap<int, QByteArray> container2;
+    QDataStream readStream(serialised);
+    readStream >> container2;
+    QVERIFY(container2 == container);
+    for (int i = 0; i < 100; i += 2)
+        container.remove(i);
+    QVERIFY(container.defrag());
+    QCOMPARE(container.fileSize(), Q_INT64_C(0));
+}
+
+void tst_HugeMap::testManyEvictions()
+{
+    // Enough values leave the cache for the index to be trimmed several times
+    HugeMap<int, QString> container;
+    QVERIFY(container.setMaxCache(8));
+    for (int i = 0; i < 10000; ++i)
+        container.insert(i, QString::number(i));
+    auto container2 = container;
+    for (int i = 0; i < 10000; i += 3)
+        container[i] = QString::number(-i);
+    for (int i = 0; i < 10000; ++i) {
+        QCOMPARE(container.value(i), QString::number(i % 3 == 0 ? -i : i));
+        QCOMPARE(container2.value(i), QString::number(i));
+    }
+}
+
 void tst_HugeMap::testGenericEmpty(bool(HugeMap<KeyClass, ValueClass>::*fn)() const){
     HugeMap<KeyClass, ValueClass> container;
     auto funcCall = std::bind(fn, &container);
@@ -686,6 +1424,25 @@ void tst_HugeMap::testErase()
     QVERIFY(!container2.contains(2));
     auto iterRemove3 = container2.erase(iterRemove2);
     QCOMPARE(iterRemove3, iterRemove2);
+    // Erasing most keys of a deep index shrinks its nodes
+    HugeMap<KeyClass, int> container3;
+    for (int i = 0; i < 5000; ++i)
+        container3.insert((i * 7919) % 5000, i);
+    for (auto i = container3.begin(); i != container3.end();) {
+        if (i.key().val() % 100 == 0)
+            ++i;
+        else
+            i = container3.erase(i);
+    }
+    QCOMPARE(container3.size(), 50);
+    int expected = 0;
+    for (auto i = container3.constBegin(); i != container3.constEnd(); ++i, expected += 100)
+        QCOMPARE(i.key().val(), expected);
+    QCOMPARE(expected, 5000);
+    QCOMPARE(container3.lowerBound(4001).key().val(), 4100);
+    while (!container3.isEmpty())
+        container3.erase(container3.begin());
+    QCOMPARE(container3.begin(), container3.end());
 }
 
 void tst_HugeMap::testFind()
@@ -711,6 +1468,95 @@ void tst_HugeMap::testFind()
     QCOMPARE(container2.find(0), container2.end());
 }
 
+void tst_HugeMap::testLowerBound()
+{
+    HugeMap<KeyClass, ValueClass> container{
+        std::make_pair(0, QStringLiteral("zero"))
+        , std::make_pair(1, QStringLiteral("one"))
+        , std::make_pair(2, QStringLiteral("two"))
+        , std::make_pair(4, QStringLiteral("four"))
+        , std::make_pair(8, QStringLiteral("eight"))
+    };
+    QCOMPARE(container.lowerBound(-1), container.begin());
+    QCOMPARE(container.lowerBound(2), container.find(2));
+    QCOMPARE(container.lowerBound(3), container.find(4));
+    QCOMPARE(container.upperBound(4), container.find(8));
+    QCOMPARE(container.lowerBound(9), container.end());
+    QCOMPARE(container.upperBound(8), container.end());
+    // Enough keys to fill several levels of the index, inserted out of order and partly removed
+    HugeMap<int, int> container2;
+    for (int i = 0; i < 5000; ++i)
+        container2.insert((i * 7919) % 5000 * 2, i);
+    for (int i = 0; i < 10000; i += 6)
+        container2.remove(i);
+    int expected = 1004;
+    for (auto i = container2.lowerBound(1001); i != container2.end(); ++i) {
+        QCOMPARE(i.key(), expected);
+        expected += expected % 6 == 2 ? 2 : 4;
+    }
+    QCOMPARE(expected, 10000);
+    auto last = container2.constEnd();
+    QCOMPARE((--last).key(), 9998);
+}
+
+void tst_HugeMap::testHashIndex()
+{
+    // Enough keys to rehash the index several times, with removals leaving deleted slots behind
+    HugeHash<int, int> container;
+    for (int i = 0; i < 5000; ++i)
+        container.insert(i * 7919, i);
+    for (int i = 0; i < 5000; i += 3)
+        QVERIFY(container.remove(i * 7919));
+    for (int i = 0; i < 5000; i += 3)
+        container.insert(-i - 1, i);
+    QCOMPARE(container.size(), 5000);
+    for (int i = 0; i < 5000; ++i) {
+        QCOMPARE(container.contains(i * 7919), i % 3 != 0);
+        if (i % 3 == 0)
+            QCOMPARE(container.value(-i - 1), i);
+    }
+    for (auto i = container.begin(); i != container.end();) {
+        if (i.key() < 0)
+            i = container.erase(i);
+        else
+            ++i;
+    }
+    QCOMPARE(container.size(), 3333);
+    int sum = 0;
+    for (auto i = container.constBegin(); i != container.constEnd(); ++i) {
+        QCOMPARE(i.key(), i.value() * 7919);
+        sum += i.value();
+    }
+    QCOMPARE(sum, 12497500 - 4165833);
+}
+
+void tst_HugeMap::testReserve()
+{
+    HugeHash<int, int> container;
+    container.reserve(1000);
+    for (int i = 0; i < 1000; ++i)
+        container.insert(i, i);
+    auto container2 = container;
+    // Growing past the reserved size moves the keys to the new table a few at a time
+    for (int i = 1000; i < 3000; ++i) {
+        container.insert(i, i);
+        if (i % 5 == 0)
+            QVERIFY(container.remove(i / 5));
+        QVERIFY(container.contains(i));
+        QVERIFY(!container.contains(i / 5) || i % 5 != 0);
+    }
+    QCOMPARE(container.size(), 2600);
+    int count = 0;
+    for (auto i = container.constBegin(); i != container.constEnd(); ++i) {
+        QCOMPARE(i.value(), i.key());
+        QVERIFY(i.key() >= 600 || i.key() < 200);
+        ++count;
+    }
+    QCOMPARE(count, 2600);
+    QCOMPARE(container2.size(), 1000);
+    QCOMPARE(container2.value(999), 999);
+}
+
 void tst_HugeMap::testConstFind()
 {
     const HugeMap<KeyClass, ValueClass> container{
@@ -34,6 +34,9 @@ private slots:
     void testKeys();
     void testLast();
     void testLastKey();
+    void testLowerBound();
+    void testHashIndex();
+    void testReserve();
     void testRemove();
     void testSize();
     void testSwap();
@@ -52,6 +55,29 @@ private slots:
     void testCompression();
     void testCacheSizeChange_data();
     void testCacheSizeChange();
+    void testCachePolicy_data();
+    void testCachePolicy();
+    void testCacheBytes();
+    void testCleanEviction();
+    void testWriteBehind();
+    void testReadAhead();
+    void testMemoryMapped();
+    void testCopyLargeFile();
+    void testConcurrentHash();
+    void testConcurrentMisses();
+    void testInsertBatch();
+    void testMultiGet();
+    void testBestFit();
+    void testSlotHeadroom();
+    void testCompact();
+    void testAutoCompaction();
+    void testPunchHole();
+    void testGrowthChunk();
+    void testLogStructured();
+    void testTrivialValues();
+    void testPagePacking();
+    void testInlineValues();
+    void testManyEvictions();
     void testFileSize();
 
     // test iterators